@@ -0,0 +1,62 @@
+/*
+ * Input of the lexer benchmark: expressions which use every operator,
+ * with short names and numbers, as in generated or macro heavy code.
+ * otccn built with -DBENCH reads it n times with next() and prints the
+ * number of tokens per second:
+ *
+ *     gcc -m32 -O2 -no-pie -DBENCH otccn.c -o otccn-bench -ldl -lpthread
+ *     ./otccn-bench otccbench.c 1000
+ *
+ * It is also a normal program, which prints a checksum.
+ */
+#include <stdio.h>
+
+#define MASK 0xffff
+#define STEP 0x9e37
+
+int a, b, c, d, s;
+
+mix(x, y)
+{
+    x = (x << 5 | x >> 27 & 31) ^ y * 33 + (x & MASK) - (y | 0x55) % 7;
+    y = (y >> 3 & 0x1fffffff) + x * 9 - (x ^ y) / 3 + ~x + !y - -x;
+    return x + y * 3 & MASK | (x != y) << 16 | (x <= y) << 17;
+}
+
+cmp(x, y)
+{
+    return (x < y) + (x > y) * 2 + (x <= y) * 4 + (x >= y) * 8 +
+        (x == y) * 16 + (x != y) * 32 + (x && y) * 64 + (x || y) * 128;
+}
+
+step(i)
+{
+    a = a + i * STEP ^ b >> 2;
+    b = b - (a & 0xff) * (i | 1) + c / (i % 13 + 1);
+    c = c ^ (a << 3) + (b >> 5 & 0x7ffffff) - ~d;
+    d = d + mix(a, b) - cmp(c & 0xff, d & 0xff) * (i & 7);
+    s = s ^ a + b * 3 - c * 5 + d * 7;
+    if (a > b && c < d || a == c & b != d)
+        s = s + 1;
+    if (!(a & 1) | (b & 2) ^ (c & 4))
+        s = s - 1;
+    return s & MASK;
+}
+
+main()
+{
+    int i, r;
+
+    a = 1;
+    b = 2;
+    c = 3;
+    d = 4;
+    r = 0;
+    i = 0;
+    while (i < 1000) {
+        r = r + step(i) * (i & 3) - (r >> 4) % 17;
+        i++;
+    }
+    printf("%d\n", r);
+    return 0;
+}
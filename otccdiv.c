@@ -0,0 +1,205 @@
+/*
+ * Self-check of the multiplications, divisions and remainders by a
+ * constant, which -O compiles with shifts, lea and multiplications by
+ * a magic number instead of imul and idiv, and of the folding of
+ * constant expressions which overflow. Each result is compared with
+ * the same operation on a variable. It prints "ok" and returns 0 if
+ * they all agree:
+ *
+ *     otccn -O otccdiv.c
+ *
+ * A standard C compiler gives the same output with -fwrapv.
+ */
+#include <stdio.h>
+
+int fails;
+
+/* 'p' is x * c computed with the constant c */
+ckm(x, c, p)
+{
+    if (p != x * c) {
+        printf("%d * %d: %d, expected %d\n", x, c, p, x * c);
+        fails++;
+    }
+}
+
+/* 'q' and 'r' are x / c and x % c computed with the constant c */
+ckd(x, c, q, r)
+{
+    int e, f;
+
+    e = x / c;
+    f = x % c;
+    if (q != e | r != f) {
+        printf("%d / %d: %d %d, expected %d %d\n", x, c, q, r, e, f);
+        fails++;
+    }
+}
+
+/* 'a' is the constant expression 'n', whose value is 'b' */
+ckf(n, a, b)
+{
+    if (a != b) {
+        printf("folding %d: %d, expected %d\n", n, a, b);
+        fails++;
+    }
+}
+m_0(x) { ckm(x, 0, x * 0); }
+m_1(x) { ckm(x, 1, x * 1); }
+m_n1(x) { ckm(x, -1, x * -1); }
+m_2(x) { ckm(x, 2, x * 2); }
+m_3(x) { ckm(x, 3, x * 3); }
+m_4(x) { ckm(x, 4, x * 4); }
+m_5(x) { ckm(x, 5, x * 5); }
+m_7(x) { ckm(x, 7, x * 7); }
+m_8(x) { ckm(x, 8, x * 8); }
+m_9(x) { ckm(x, 9, x * 9); }
+m_10(x) { ckm(x, 10, x * 10); }
+m_100(x) { ckm(x, 100, x * 100); }
+m_127(x) { ckm(x, 127, x * 127); }
+m_128(x) { ckm(x, 128, x * 128); }
+m_n128(x) { ckm(x, -128, x * -128); }
+m_129(x) { ckm(x, 129, x * 129); }
+m_1000(x) { ckm(x, 1000, x * 1000); }
+m_65536(x) { ckm(x, 65536, x * 65536); }
+m_1073741824(x) { ckm(x, 1073741824, x * 1073741824); }
+m_2147483647(x) { ckm(x, 2147483647, x * 2147483647); }
+m_n2147483647(x) { ckm(x, -2147483647, x * -2147483647); }
+m_min(x) { ckm(x, (-2147483647 - 1), x * (-2147483647 - 1)); }
+
+d_1(x) { ckd(x, 1, x / 1, x % 1); }
+d_n1(x) { ckd(x, -1, x / -1, x % -1); }
+d_2(x) { ckd(x, 2, x / 2, x % 2); }
+d_n2(x) { ckd(x, -2, x / -2, x % -2); }
+d_3(x) { ckd(x, 3, x / 3, x % 3); }
+d_n3(x) { ckd(x, -3, x / -3, x % -3); }
+d_4(x) { ckd(x, 4, x / 4, x % 4); }
+d_5(x) { ckd(x, 5, x / 5, x % 5); }
+d_6(x) { ckd(x, 6, x / 6, x % 6); }
+d_7(x) { ckd(x, 7, x / 7, x % 7); }
+d_n7(x) { ckd(x, -7, x / -7, x % -7); }
+d_8(x) { ckd(x, 8, x / 8, x % 8); }
+d_9(x) { ckd(x, 9, x / 9, x % 9); }
+d_10(x) { ckd(x, 10, x / 10, x % 10); }
+d_12(x) { ckd(x, 12, x / 12, x % 12); }
+d_25(x) { ckd(x, 25, x / 25, x % 25); }
+d_100(x) { ckd(x, 100, x / 100, x % 100); }
+d_125(x) { ckd(x, 125, x / 125, x % 125); }
+d_128(x) { ckd(x, 128, x / 128, x % 128); }
+d_n128(x) { ckd(x, -128, x / -128, x % -128); }
+d_641(x) { ckd(x, 641, x / 641, x % 641); }
+d_1000(x) { ckd(x, 1000, x / 1000, x % 1000); }
+d_65536(x) { ckd(x, 65536, x / 65536, x % 65536); }
+d_1073741823(x) { ckd(x, 1073741823, x / 1073741823, x % 1073741823); }
+d_1073741824(x) { ckd(x, 1073741824, x / 1073741824, x % 1073741824); }
+d_1073741825(x) { ckd(x, 1073741825, x / 1073741825, x % 1073741825); }
+d_2147483647(x) { ckd(x, 2147483647, x / 2147483647, x % 2147483647); }
+d_n2147483647(x) { ckd(x, -2147483647, x / -2147483647, x % -2147483647); }
+d_n1073741824(x) { ckd(x, -1073741824, x / -1073741824, x % -1073741824); }
+d_min(x) { ckd(x, (-2147483647 - 1), x / (-2147483647 - 1), x % (-2147483647 - 1)); }
+
+check(x)
+{
+    m_0(x);
+    m_1(x);
+    m_n1(x);
+    m_2(x);
+    m_3(x);
+    m_4(x);
+    m_5(x);
+    m_7(x);
+    m_8(x);
+    m_9(x);
+    m_10(x);
+    m_100(x);
+    m_127(x);
+    m_128(x);
+    m_n128(x);
+    m_129(x);
+    m_1000(x);
+    m_65536(x);
+    m_1073741824(x);
+    m_2147483647(x);
+    m_n2147483647(x);
+    m_min(x);
+    d_1(x);
+    /* idiv faults on 0x80000000 / -1 */
+    if (x != -2147483647 - 1)
+        d_n1(x);
+    d_2(x);
+    d_n2(x);
+    d_3(x);
+    d_n3(x);
+    d_4(x);
+    d_5(x);
+    d_6(x);
+    d_7(x);
+    d_n7(x);
+    d_8(x);
+    d_9(x);
+    d_10(x);
+    d_12(x);
+    d_25(x);
+    d_100(x);
+    d_125(x);
+    d_128(x);
+    d_n128(x);
+    d_641(x);
+    d_1000(x);
+    d_65536(x);
+    d_1073741823(x);
+    d_1073741824(x);
+    d_1073741825(x);
+    d_2147483647(x);
+    d_n2147483647(x);
+    d_n1073741824(x);
+    d_min(x);
+}
+
+fold()
+{
+    int m;
+
+    m = 46341;
+    ckf(1, 46341 * 46341, m * m);
+    m = 2147483647;
+    ckf(2, 2147483647 + 1, m + 1);
+    ckf(3, -2147483647 - 2, 0 - m - 2);
+    ckf(4, -(-2147483647 - 1), 0 - (0 - m - 1));
+    ckf(5, (-2147483647 - 1) * -1, (0 - m - 1) * -1);
+    m = 1;
+    ckf(6, 1 << 31, m << 31);
+    m = -1;
+    ckf(7, -1 << 31, m << 31);
+}
+
+main()
+{
+    int i, x;
+
+    /* around the powers of two, INT_MIN and INT_MAX included */
+    i = 0;
+    while (i < 32) {
+        x = 1 << i;
+        check(x);
+        check(x - 1);
+        check(x + 1);
+        check(0 - x);
+        check(0 - x - 1);
+        check(0 - x + 1);
+        i++;
+    }
+    /* pseudo random values */
+    x = 1;
+    i = 0;
+    while (i < 2000) {
+        x = x * 1103515245 + 12345;
+        check(x);
+        check(x >> (i & 31));
+        i++;
+    }
+    fold();
+    if (!fails)
+        printf("ok\n");
+    return fails;
+}
@@ -23,6 +23,12 @@
 #include <stdarg.h>
 #endif
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <immintrin.h>
 
 /* vars: value of variables 
    loc : local variable index
@@ -33,53 +39,145 @@
    rsym: return symbol
    sym_stk: symbol stack
    dstk: symbol stack pointer
-   dptr, dch: macro state
+   sym_hash: identifier hash table (tokens of the symbols)
+   sym_cnt: number of symbols
+   op_tab: operator lists indexed by their first character
+   file: source text (mapped or read in memory)
+   fptr: source read pointer, fend: end of source
+   dptr: define tokens being replayed
+   dexp..dexp_sp: defines being expanded, as (symbol, tokens after
+         it), dexp_end: end of dexp
+   tcache: token cache file name
+   tbuf, tptr, tend: token cache buffer and pointers
+   trd: tokens read from the token cache or the chunks
+   tmap: records of the chunk symbols, tchunk..tchunk_end: chunks
+   ring: tokens from the lexer thread, ring_wr/ring_rd: number of
+         tokens written/read, ring_lim: ring_wr as seen by the parser
+   lex_ctx: state of the lexer thread
+   lex_jobs: number of threads for parallel lexing
+   arena_next: address of the next arena
+   mem_stats: print the memory usage
+   simd: 2 if the processor has AVX2, 1 if it has SSE2, else 0
+   str_buf..str_end: string records (str_cnt strings), str_hash: their
+         hash table, str_bytes: size of the string pool
+   fc_dir: function cache directory, fc_path/fc_new: old and new
+         cache files, fc_tab: hash table (size fc_mask + 1) of the
+         functions of the old file fc_old..fc_oend, fc_seq: next
+         function if the old file is kept, fc_file: new file
+   fc_tok..fc_tend: tokens of the current function (fc_tlim: end of
+         the buffer), fc_rd: tokens given again to the parser
+   fc_rel..fc_rend: uses recorded while compiling the function at
+         fc_code (zero if not recording)
+   fc_h, fc_g: hash of the current function
+   opt: optimize (-O), ra_tab..ra_end, ra_lp..ra_lend, ra_used,
+         ra_loc: register allocation of the current function (see
+         ra_scan), ra_out: size of its outgoing argument area, ra_arg:
+         size of its parameters, ra_addr: the address of a parameter
+         or local is taken, ra_top: code after its prologue, ra_esp:
+         %esp is %ebp - ra_esp in its body, ra_inl: hash table of the
+         functions which can be inlined (see ra_keep)
+   su_at, su_end, su_k, su_v, su_edx: expression temporaries (see
+         su_keep), su_sp: bytes pushed below the outgoing area
+   su_set: end of the code of the last comparison, su_cc: its
+         condition, su_stop: token after the operand seen by su_scan
+   lsym: last address given to gsym(), the jumps to it cannot be
+         removed
 
    * 'vars' format: 
-   For each character TAG_TOK at offset 'i' before a
-    symbol in sym_stk, we have:
-    v = (int *)(vars + 8 * i + TOK_IDENT)[0] 
-    p = (int *)(vars + 8 * i + TOK_IDENT)[0] 
+   Symbols are numbered in order of appearance. For the symbol of
+    id 'i', we have a record of SYM_SIZE bytes at
+    r = vars + t, where t = SYM_SIZE * i + TOK_IDENT is its token:
+    v = (int *)r[0] value
+    p = (int *)r[1] list of use points
+    d = (int *)r[2] pointer to define tokens
+    s = (int *)r[3] pointer to symbol name
     
     v = 0    : undefined symbol, p = list of use points.
-    v = 1    : define symbol, p = pointer to define text.
-    v < LOCAL: offset on stack, p = 0.
+    v = 1    : define symbol, d = pointer to define tokens.
+    v < LOCAL: offset on stack, p = 0. With -O, a variable in a
+               register has the register number (3, 6 or 7) while
+               its function is compiled.
     otherwise: symbol with value 'v', p = list of use points.
 
    * 'sym_stk' format:
-   TAG_TOK sym1 TAG_TOK sym2 .... symN '\0'
-   'dstk' points to the last '\0'.
+   sym1 '\0' sym2 '\0' .... symN '\0', define tokens in between.
+   The tokens of a define are a list of (tok, tokc, tokl, next)
+   entries ending with an EOF (-1) token.
+   'dstk' points after the last '\0'.
 */
-int tok, tokc, tokl, ch, vars, rsym, prog, ind, loc, glo, file, sym_stk, dstk, dptr, dch, last_id, data, text, data_offset;
+/* each thread has its own token, lexer state and symbol table */
+__thread int tok, tokc, tokl, ch, fptr, fend, dptr, dexp, dexp_sp, dexp_end, last_id, vars, sym_hash, sym_cnt, dstk, tbuf, tptr, tend;
+int rsym, prog, ind, loc, glo, file, sym_stk, op_tab, tcache, trd, tmap, tchunk, tchunk_end, ring, ring_wr, ring_rd, ring_lim, lex_ctx, lex_jobs, arena_next, mem_stats, simd, str_buf, str_end, str_cnt, str_hash, str_bytes, fc_dir, fc_path, fc_new, fc_file, fc_old, fc_oend, fc_seq, fc_tab, fc_mask, fc_tok, fc_tend, fc_tlim, fc_rd, fc_rel, fc_rend, fc_rlim, fc_code, fc_h, fc_g, opt, ra_tab, ra_end, ra_lp, ra_lend, ra_used, ra_loc, ra_out, ra_arg, ra_addr, ra_top, ra_esp, ra_inl, su_at, su_end, su_k, su_v, su_edx, su_sp, su_set, su_cc, su_stop, lsym, data, text, data_offset;
+
+/* address range reserved for each arena (sym_stk, vars, data, code
+   and strings): only the pages which are touched are allocated */
+#define ARENA_SIZE 0x8000000
+
+/* address range of all the arenas: the five fixed ones use 640 MB,
+   the rest is left for the -jN chunk tables (about 25 bytes per
+   source byte). Pointers stay positive. */
+#define ARENA_BASE 0x20000000
+#define ARENA_END  0x80000000
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
-#define ALLOC_SIZE 99999
+/* initial number of identifier hash table slots (must be a power of
+   two), also the number of string pool hash buckets */
+#define HASH_SIZE  0x10000
 
 #define ELFOUT
 
 /* depends on the init string */
-#define TOK_STR_SIZE 48
 #define TOK_IDENT    0x100
 #define TOK_INT      0x100
-#define TOK_IF       0x120
-#define TOK_ELSE     0x138
-#define TOK_WHILE    0x160
-#define TOK_BREAK    0x190
-#define TOK_RETURN   0x1c0
-#define TOK_FOR      0x1f8
-#define TOK_DEFINE   0x218
-#define TOK_MAIN     0x250
+#define TOK_IF       0x110
+#define TOK_ELSE     0x120
+#define TOK_WHILE    0x130
+#define TOK_BREAK    0x140
+#define TOK_RETURN   0x150
+#define TOK_FOR      0x160
+#define TOK_DEFINE   0x170
+#define TOK_MAIN     0x180
 
 #define TOK_DUMMY   1
 #define TOK_NUM     2
 
 #define LOCAL   0x200
 
+/* maximum number of tokens of the expression of an inlined function
+   (-O) */
+#define INLINE_MAX  24
+
 #define SYM_FORWARD 0
-#define SYM_DEFINE  1
+
+/* size of a symbol record in vars: value, use list, define text, name */
+#define SYM_SIZE    16
+
+/* token cache: header size and magic ("OTK2") */
+#define TC_HEADER   24
+#define TC_MAGIC    0x324b544f
+
+/* number of (tok, tokc, tokl) entries of the lexer ring (a power of
+   two) */
+#define RING_SIZE   4096
+
+/* size of a lexer state block (lex_save()) */
+#define LEX_CTX     40
+
+/* minimum size of a chunk for parallel lexing */
+#define LEX_CHUNK   0x100000
+
+/* function cache magic ("OTF2"), and header size: the magic and the
+   hash of FC_BUILD. The cache of another build of otccelfn is not
+   used, since its code generator may differ. */
+#define FC_MAGIC    0x3246544f
+#define FC_HEADER   8
+#define FC_BUILD    __DATE__ " " __TIME__
 
 /* tokens in string heap */
 #define TAG_TOK    ' '
-#define TAG_MACRO  2
 
 /* additionnal elf output defines */
 #ifdef ELFOUT
@@ -87,7 +185,7 @@ int tok, tokc, tokl, ch, vars, rsym, prog, ind, loc, glo, file, sym_stk, dstk, d
 #define ELF_BASE      0x08048000
 #define PHDR_OFFSET   0x30
 
-#define INTERP_OFFSET 0x90
+#define INTERP_OFFSET 0xb0
 #define INTERP_SIZE   0x13
 
 #ifndef TINY
@@ -96,10 +194,10 @@ int tok, tokc, tokl, ch, vars, rsym, prog, ind, loc, glo, file, sym_stk, dstk, d
 
 #define ELFSTART_SIZE  (DYNAMIC_OFFSET + DYNAMIC_SIZE)
 #else
-#define DYNAMIC_OFFSET 0xa4
+#define DYNAMIC_OFFSET 0xc4
 #define DYNAMIC_SIZE   0x58
 
-#define ELFSTART_SIZE  0xfc
+#define ELFSTART_SIZE  0x11c
 #endif
 
 /* size of startup code */
@@ -110,6 +208,33 @@ int tok, tokc, tokl, ch, vars, rsym, prog, ind, loc, glo, file, sym_stk, dstk, d
 
 #endif
 
+/* reserve 'n' bytes of zeroed memory which never moves, so that the
+   absolute addresses patched in it stay valid. Only the touched pages
+   are allocated. An inaccessible page follows it, so that an overflow
+   faults instead of corrupting memory. All the arenas are mapped at
+   their address below ARENA_END, so that pointers stay positive. */
+arena(n)
+{
+    int a, h;
+
+    n = n + 0xfff & -0x1000;
+    h = __atomic_fetch_add(&arena_next, n + 0x1000, __ATOMIC_RELAXED);
+    if ((unsigned)h + n + 0x1000 > ARENA_END) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    a = mmap(h, n + 0x1000, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+             MAP_FIXED_NOREPLACE, -1, 0);
+    /* older kernels take the address as a hint only */
+    if (a != h) {
+        fprintf(stderr, "cannot map memory at 0x%x\n", h);
+        exit(1);
+    }
+    mprotect(a + n, 0x1000, PROT_NONE);
+    return a;
+}
+
 pdef(t)
 {
     *(char *)dstk++ = t;
@@ -117,17 +242,107 @@ pdef(t)
 
 inp()
 {
-    if (dptr) {
-        ch = *(char *)dptr++;
-        if (ch == TAG_MACRO) {
-            dptr = 0;
-            ch = dch;
-        }
-    } else
-        ch = fgetc(file);
+    if (fptr < fend)
+        ch = *(char *)fptr++ & 0xff;
+    else
+        ch = -1;
     /*    printf("ch=%c 0x%x\n", ch, ch); */
 }
 
+/* load the source file 't' (stdin if zero) in memory: it is mapped
+   if possible, otherwise read in a buffer. A zero always follows the
+   text so that strtol() stops there. */
+src_load(t)
+{
+    int fd, n, l, a;
+
+    fd = 0;
+    if (t)
+        fd = open(t, O_RDONLY);
+    if (fd < 0) {
+        perror(t);
+        exit(1);
+    }
+    n = lseek(fd, 0, SEEK_END);
+    file = -1;
+    if (n > 0 & (n & (getpagesize() - 1)) != 0)
+        file = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == -1) {
+        lseek(fd, 0, SEEK_SET);
+        a = 0x10000;
+        n = 0;
+        file = malloc(a + 1);
+        while ((l = read(fd, file + n, a - n)) > 0) {
+            n = n + l;
+            if (n == a) {
+                a = a * 2;
+                file = realloc(file, a + 1);
+            }
+        }
+        *(char *)(file + n) = 0;
+    }
+    fptr = file;
+    fend = file + n;
+}
+
+/* blanks (' ', '\t', '\n', '\v', '\f', '\r') are found 32 or 16 bytes
+   at a time with AVX2 or SSE2 when the processor has them (simd, set
+   in main()). The functions are compiled for these instruction sets
+   whatever the target of the build. */
+
+/* return the first 32 byte block at or after 't' which is not only
+   blanks, at its first non blank byte, or the end of the last one */
+__attribute__((target("avx2"))) skip_avx2(t)
+{
+    __m256i v, b;
+    int m;
+
+    while (t + 32 <= fend) {
+        v = _mm256_loadu_si256((__m256i *)t);
+        b = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+        b = _mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8(4)), b);
+        b = _mm256_or_si256(b, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        m = ~_mm256_movemask_epi8(b);
+        if (m)
+            return t + __builtin_ctz(m);
+        t = t + 32;
+    }
+    return t;
+}
+
+/* the same with 16 byte blocks */
+__attribute__((target("sse2"))) skip_sse2(t)
+{
+    __m128i v, b;
+    int m;
+
+    while (t + 16 <= fend) {
+        v = _mm_loadu_si128((__m128i *)t);
+        /* 9 <= c <= 13 or c == ' ' */
+        b = _mm_sub_epi8(v, _mm_set1_epi8(9));
+        b = _mm_cmpeq_epi8(_mm_min_epu8(b, _mm_set1_epi8(4)), b);
+        b = _mm_or_si128(b, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        m = ~_mm_movemask_epi8(b) & 0xffff;
+        if (m)
+            return t + __builtin_ctz(m);
+        t = t + 16;
+    }
+    return t;
+}
+
+/* return the first byte of the source at or after 't' which is not a
+   blank, or fend */
+skip_blanks(t)
+{
+    if (simd == 2)
+        t = skip_avx2(t);
+    if (simd)
+        t = skip_sse2(t);
+    while (t < fend && isspace(*(char *)t & 0xff))
+        t++;
+    return t;
+}
+
 isid()
 {
     return isalnum(ch) | ch == '_';
@@ -143,27 +358,233 @@ getq()
     }
 }
 
-next()
+/* hash value of the identifier of length 'l' at 't' */
+sym_hval(t, l)
+{
+    int h;
+
+    h = 0;
+    while (l--)
+        h = (h * 33 + *(char *)t++) & 0xffffff;
+    return h;
+}
+
+/* size of the identifier hash table: HASH_SIZE, doubled until it is
+   more than twice the number of symbols */
+sym_size()
+{
+    int m;
+
+    m = HASH_SIZE;
+    while (m <= sym_cnt * 2)
+        m = m * 2;
+    return m;
+}
+
+/* move the identifiers of the hash table of size 'm' to a new table
+   of twice the size */
+sym_grow(m)
+{
+    int a, p, h, t;
+
+    a = sym_hash;
+    sym_hash = calloc(8, m);
+    p = a;
+    while (p < a + m * 4) {
+        if (*(int *)p) {
+            t = *(int *)(vars + *(int *)p + 12);
+            h = sym_hval(t, strlen(t));
+            while (*(int *)(sym_hash + (h & m * 2 - 1) * 4))
+                h++;
+            *(int *)(sym_hash + (h & m * 2 - 1) * 4) = *(int *)p;
+        }
+        p = p + 4;
+    }
+    free(a);
+}
+
+/* find the identifier of length 'l' at 'last_id' (in the source or
+   in a define text) in the hash table and return its token value. A
+   new identifier gets the next symbol id and its name is copied to
+   the symbol stack. In both cases 'last_id' is left on the stored
+   name. */
+sym_find(l)
+{
+    int h, t, p, m;
+
+    m = sym_size();
+    h = sym_hval(last_id, l);
+    while (1) {
+        h = h & (m - 1);
+        p = *(int *)(sym_hash + h * 4);
+        if (!p)
+            break;
+        t = *(int *)(vars + p + 12);
+        if (!memcmp(t, last_id, l) & !*(char *)(t + l)) {
+            last_id = t;
+            return p;
+        }
+        h++;
+    }
+    /* first occurrence: keep a copy of the name */
+    p = sym_cnt++ * SYM_SIZE + TOK_IDENT;
+    *(int *)(sym_hash + h * 4) = p;
+    *(int *)(vars + p + 12) = dstk;
+    memcpy(dstk, last_id, l);
+    last_id = dstk;
+    dstk = dstk + l;
+    pdef(0);
+    /* keep the table at most half full */
+    if (sym_cnt * 2 == m)
+        sym_grow(m);
+    return p;
+}
+
+/* enter the keywords in the symbol table, in token order */
+sym_init()
+{
+    int t;
+
+    t = "int if else while break return for define main ";
+    while (*(char *)t) {
+        last_id = t;
+        while (*(char *)t != TAG_TOK)
+            t++;
+        sym_find(t - last_id);
+        t++;
+    }
+}
+
+/* decode the operator string once. 'op_tab' gives for each first
+   character the list of its operators, in string order. Each entry
+   holds the second character ('@' if none), tokc, tokl and the next
+   entry. */
+op_init()
+{
+    int t, l, a, e;
+
+    op_tab = calloc(1, 256 * 4 + 32 * 16);
+    e = op_tab + 256 * 4;
+    t = "++#m--%am*@R<^1c/@%[_[H3c%@%[_[H3c+@.B#d-@%:_^BKd<<Z/03e>>`/03e<=0f>=/f<@.f>@1f==&g!=\'g&&k||#l&@.BCh^@.BSi|@.B+j~@/%Yd!@&d*@b";
+    while (l = *(char *)t++) {
+        *(int *)e = *(char *)t++;
+        tokc = 0;
+        while ((tokl = *(char *)t++ - 'b') < 0)
+            tokc = tokc * 64 + tokl + 64;
+        *(int *)(e + 4) = tokc;
+        *(int *)(e + 8) = tokl;
+        /* append to the list of 'l' */
+        a = op_tab + l * 4;
+        while (*(int *)a)
+            a = *(int *)a + 12;
+        *(int *)a = e;
+        e = e + 16;
+    }
+}
+
+/* append (t, c, l) to a define list, 'a' being where to link it.
+   Return where to link the next token. */
+def_put(a, t, c, l)
+{
+    dstk = dstk + 3 & -4;
+    *(int *)a = dstk;
+    *(int *)dstk = t;
+    *(int *)(dstk + 4) = c;
+    *(int *)(dstk + 8) = l;
+    a = dstk + 12;
+    dstk = dstk + 16;
+    return a;
+}
+
+/* start the expansion of 'tok' if it is a define which is not being
+   expanded, and return 1. As in the original, the names of a define
+   body are expanded when it is replayed, and a define being expanded
+   is not expanded again, as in C. */
+def_expand()
+{
+    int t;
+
+    if (tok <= TOK_DEFINE || !*(int *)(tok + 8))
+        return 0;
+    t = dexp;
+    while (t < dexp_sp) {
+        if (*(int *)t == tok)
+            return 0;
+        t = t + 8;
+    }
+    if (dexp_sp == dexp_end) {
+        t = dexp_sp - dexp;
+        dexp = realloc(dexp, t * 2 + 64);
+        dexp_sp = dexp + t;
+        dexp_end = dexp + t * 2 + 64;
+    }
+    *(int *)dexp_sp = tok;
+    *(int *)(dexp_sp + 4) = dptr;
+    dexp_sp = dexp_sp + 8;
+    dptr = *(int *)(tok + 8);
+    return 1;
+}
+
+/* read the next token of the defines being expanded. Return 0 once
+   they are all replayed. */
+def_next()
+{
+    while (dptr) {
+        tok = *(int *)dptr;
+        if (tok == -1) {
+            dexp_sp = dexp_sp - 8;
+            dptr = *(int *)(dexp_sp + 4);
+        } else {
+            tokc = *(int *)(dptr + 4);
+            tokl = *(int *)(dptr + 8);
+            dptr = *(int *)(dptr + 12);
+            if (!def_expand())
+                return 1;
+        }
+    }
+    return 0;
+}
+
+lex()
+{
+    if (def_next())
+        return;
+    lex_src();
+    if (def_expand())
+        lex();
+}
+
+/* read a token from the source, without expanding the defines */
+lex_src()
 {
     int t, l, a;
 
     while (isspace(ch) | ch == '#') {
         if (ch == '#') {
+            /* a directive is lexed up to the end of its line, where
+               lex_src() returns EOF */
+            l = fend;
+            t = memchr(fptr, '\n', fend - fptr);
+            if (t)
+                fend = t;
             inp();
-            next();
+            lex_src();
             if (tok == TOK_DEFINE) {
-                next();
-                pdef(TAG_TOK); /* fill last ident tag */
-                *(int *)tok = SYM_DEFINE;
-                *(int *)(tok + 4) = dstk; /* define stack */
-            }
-            /* well we always save the values ! */
-            while (ch != '\n') {
-                pdef(ch);
-                inp();
+                lex_src();
+                /* list of the define tokens, up to EOF. New names are
+                   stored in between. */
+                t = tok + 8;
+                while (tok != -1) {
+                    lex_src();
+                    t = def_put(t, tok, tokc, tokl);
+                }
             }
-            pdef(ch);
-            pdef(TAG_MACRO);
+            /* other directives are ignored */
+            fptr = fend;
+            fend = l;
+        } else {
+            /* skip the following blanks of the source at once */
+            fptr = skip_blanks(fptr);
         }
         inp();
     }
@@ -171,36 +592,35 @@ next()
     tok = ch;
     /* encode identifiers & numbers */
     if (isid()) {
-        pdef(TAG_TOK);
-        last_id = dstk;
+        /* the text is taken in place from the source */
+        last_id = fptr - 1;
+        l = 0;
         while (isid()) {
-            pdef(ch);
+            l++;
             inp();
         }
         if (isdigit(tok)) {
             tokc = strtol(last_id, 0, 0);
             tok = TOK_NUM;
         } else {
-            *(char *)dstk = TAG_TOK; /* no need to mark end of string (we
-                                        suppose data is initied to zero */
-            tok = strstr(sym_stk, last_id - 1) - sym_stk;
-            *(char *)dstk = 0;   /* mark real end of ident for dlsym() */
-            tok = tok * 8 + TOK_IDENT;
+            tok = sym_find(l);
             if (tok > TOK_DEFINE) {
                 tok = vars + tok;
                 /*        printf("tok=%s %x\n", last_id, tok); */
-                /* define handling */
-                if (*(int *)tok == SYM_DEFINE) {
-                    dptr = *(int *)(tok + 4);
-                    dch = ch;
-                    inp();
-                    next();
-                }
             }
         }
     } else {
         inp();
-        if (tok == '\'') {
+        if (tok == '\"') {
+            /* the text is decoded by the parser */
+            tokc = fptr - 1;
+            while (ch != '\"' & ch != -1) {
+                if (ch == '\\')
+                    inp();
+                inp();
+            }
+            inp();
+        } else if (tok == '\'') {
             tok = TOK_NUM;
             getq();
             tokc = ch;
@@ -209,26 +629,35 @@ next()
         } else if (tok == '/' & ch == '*') {
             inp();
             while (ch) {
-                while (ch != '*')
+                if (ch != '*') {
+                    /* go to the next '*' (memchr() is vectorized) */
+                    t = memchr(fptr, '*', fend - fptr);
+                    fptr = fend;
+                    if (t)
+                        fptr = t;
+                    inp();
+                }
+                while (ch != '*' & ch != -1)
                     inp();
                 inp();
-                if (ch == '/')
+                if (ch == '/' | ch == -1)
                     ch = 0;
             }
             inp();
-            next();
+            lex_src();
         } else
         {
-            t = "++#m--%am*@R<^1c/@%[_[H3c%@%[_[H3c+@.B#d-@%:_^BKd<<Z/03e>>`/03e<=0f>=/f<@.f>@1f==&g!=\'g&&k||#l&@.BCh^@.BSi|@.B+j~@/%Yd!@&d*@b";
-            while (l = *(char *)t++) {
-                a = *(char *)t++;
-                tokc = 0;
-                while ((tokl = *(char *)t++ - 'b') < 0)
-                    tokc = tokc * 64 + tokl + 64;
-                if (l == tok & (a == ch | a == '@')) {
+            tokc = 0;
+            /* EOF (-1) falls in the empty slot 255 */
+            t = *(int *)(op_tab + (tok & 255) * 4);
+            while (t) {
+                a = *(int *)t;
+                if (a == ch | a == '@') {
+                    tokc = *(int *)(t + 4);
+                    tokl = *(int *)(t + 8);
 #if 0
                     printf("%c%c -> tokl=%d tokc=0x%x\n", 
-                           l, a, tokl, tokc);
+                           tok, a, tokl, tokc);
 #endif
                     if (a == ch) {
                         inp();
@@ -236,6 +665,7 @@ next()
                     }
                     break;
                 }
+                t = *(int *)(t + 12);
             }
         }
     }
@@ -245,14 +675,11 @@ next()
 
         printf("tok=0x%x ", tok);
         if (tok >= TOK_IDENT) {
-            printf("'");
             if (tok > TOK_DEFINE) 
-                p = sym_stk + 1 + (tok - vars - TOK_IDENT) / 8;
+                p = tok;
             else
-                p = sym_stk + 1 + (tok - TOK_IDENT) / 8;
-            while (*(char *)p != TAG_TOK && *(char *)p)
-                printf("%c", *(char *)p++);
-            printf("'\n");
+                p = vars + tok;
+            printf("'%s'\n", *(int *)(p + 12));
         } else if (tok == TOK_NUM) {
             printf("%d\n", tokc);
         } else {
@@ -262,6 +689,959 @@ next()
 #endif
 }
 
+/* make room for 'n' more bytes in the token cache buffer */
+tbuf_room(n)
+{
+    int a;
+
+    if (tptr + n > tend) {
+        a = (tend - tbuf) * 2 + n;
+        n = tptr - tbuf;
+        tbuf = realloc(tbuf, a);
+        tptr = tbuf + n;
+        tend = tbuf + a;
+    }
+}
+
+/* add the bytes from 't' to 'e' to the FNV-1a hash 'h' */
+hash_add(h, t, e)
+{
+    while (t < e)
+        h = (h ^ *(char *)t++ & 0xff) * 0x01000193;
+    return h;
+}
+
+/* FNV-1a hash of the bytes from 't' to 'e': the source is the key of
+   the token cache, which also checks its own contents with it, as
+   the function cache does */
+mem_hash(t, e)
+{
+    return hash_add(0x811c9dc5, t, e);
+}
+
+/* check the token cache 'a' of 'n' bytes before it is used: it is
+   made from the source, its contents have their hash, and the names, the tokens up to EOF, their
+   symbols and their strings are inside the file and the source.
+   Return 0 if not. */
+cache_check(a, n)
+{
+    int t, e, s, c;
+
+    if (n < TC_HEADER || *(int *)a != TC_MAGIC ||
+        *(int *)(a + 4) != mem_hash(file, fend) ||
+        *(int *)(a + 8) != fend - file ||
+        *(int *)(a + 20) != mem_hash(a + TC_HEADER, a + n))
+        return 0;
+    /* names */
+    s = *(int *)(a + 12);
+    c = *(int *)(a + 16);
+    if (c < TC_HEADER | c > n | s < 0)
+        return 0;
+    e = a + c;
+    t = e;
+    c = s;
+    while (c--) {
+        t = memchr(t, 0, a + n - t);
+        if (!t)
+            return 0;
+        t++;
+    }
+    /* tokens */
+    t = a + TC_HEADER;
+    while (t + 4 <= e) {
+        s = *(int *)t;
+        t = t + 4;
+        c = 0;
+        if (s & 1) {
+            if (t + 8 > e)
+                return 0;
+            c = *(int *)t;
+            t = t + 8;
+        }
+        s = s >> 1;
+        if (s == -1)
+            return 1;
+        if (s < 0 | s >= TOK_IDENT + *(int *)(a + 12) * SYM_SIZE |
+            s >= TOK_IDENT & (s & SYM_SIZE - 1) != 0 |
+            s == '\"' & (c < 1 | c > fend - file))
+            return 0;
+    }
+    return 0;
+}
+
+/* token cache: if the file 'tcache' was made from the same source,
+   its symbols are entered in the same order and next() reads its
+   tokens (trd) instead of lexing. Otherwise the tokens are kept in 'tbuf' to
+   be saved by cache_save().
+
+   format: magic, source hash, source size, symbol count, offset of the
+   names, hash of the rest of the file, the tokens up to EOF, then the symbol names ('\0'
+   terminated). A token is 'tok * 2', or 'tok * 2 + 1' followed by
+   tokc and tokl if they are used. Symbols are stored as their token
+   value and strings as an offset in the source. */
+cache_open()
+{
+    int fd, n, a, t;
+
+    fd = open(tcache, O_RDONLY);
+    if (fd >= 0) {
+        n = lseek(fd, 0, SEEK_END);
+        a = -1;
+        if (n >= TC_HEADER)
+            a = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (a != -1 && cache_check(a, n)) {
+            /* enter the symbols in the same order */
+            n = *(int *)(a + 12);
+            t = a + *(int *)(a + 16);
+            while (n--) {
+                last_id = t;
+                t = t + strlen(t);
+                sym_find(t - last_id);
+                t++;
+            }
+            /* the tokens give symbol numbers: the names must differ */
+            if (sym_cnt != *(int *)(a + 12)) {
+                fprintf(stderr, "%s: corrupt token cache\n", tcache);
+                exit(1);
+            }
+            trd = a + TC_HEADER;
+            return;
+        }
+        if (a != -1)
+            munmap(a, n);
+    }
+    tbuf = tptr = malloc(0x10000);
+    tend = tbuf + 0x10000;
+    tptr = tptr + TC_HEADER;
+}
+
+/* write the token cache (after a successful compilation) */
+cache_save()
+{
+    int f, a, t, l;
+
+    if (!tbuf)
+        return;
+    *(int *)tbuf = TC_MAGIC;
+    *(int *)(tbuf + 4) = mem_hash(file, fend);
+    *(int *)(tbuf + 8) = fend - file;
+    *(int *)(tbuf + 12) = sym_cnt;
+    *(int *)(tbuf + 16) = tptr - tbuf;
+    a = vars + TOK_IDENT;
+    while (a < vars + TOK_IDENT + sym_cnt * SYM_SIZE) {
+        t = *(int *)(a + 12);
+        l = strlen(t) + 1;
+        tbuf_room(l);
+        memcpy(tptr, t, l);
+        tptr = tptr + l;
+        a = a + SYM_SIZE;
+    }
+    *(int *)(tbuf + 20) = mem_hash(tbuf + TC_HEADER, tptr);
+    /* a new file replaces the old one, which is never seen half
+       written */
+    a = malloc(strlen(tcache) + 5);
+    sprintf(a, "%s.tmp", tcache);
+    f = fopen(a, "w");
+    if (f) {
+        l = fwrite(tbuf, 1, tptr - tbuf, f) != tptr - tbuf;
+        if (fclose(f) | l)
+            remove(a);
+        else
+            rename(a, tcache);
+    }
+}
+
+/* append the current token to the token cache buffer */
+tok_put()
+{
+    int t, c;
+
+    tbuf_room(12);
+    t = tok;
+    if (t > TOK_DEFINE)
+        t = t - vars;
+    c = tokc;
+    if (tok == '\"')
+        c = c - file;
+    if (tok < TOK_IDENT & (c | tokl) != 0) {
+        *(int *)tptr = t * 2 + 1;
+        *(int *)(tptr + 4) = c;
+        *(int *)(tptr + 8) = tokl;
+        tptr = tptr + 12;
+    } else {
+        *(int *)tptr = t * 2;
+        tptr = tptr + 4;
+    }
+}
+
+/* lexer state of a thread: ch, fptr, fend, dptr and its symbol table
+   (vars, sym_hash, sym_cnt, dstk) are per thread. They are passed
+   between threads in a block of LEX_CTX bytes. */
+lex_save(c)
+{
+    *(int *)c = ch;
+    *(int *)(c + 4) = fptr;
+    *(int *)(c + 8) = fend;
+    *(int *)(c + 12) = dptr;
+    *(int *)(c + 16) = vars;
+    *(int *)(c + 20) = sym_hash;
+    *(int *)(c + 24) = sym_cnt;
+    *(int *)(c + 28) = dstk;
+}
+
+lex_load(c)
+{
+    ch = *(int *)c;
+    fptr = *(int *)(c + 4);
+    fend = *(int *)(c + 8);
+    dptr = *(int *)(c + 12);
+    vars = *(int *)(c + 16);
+    sym_hash = *(int *)(c + 20);
+    sym_cnt = *(int *)(c + 24);
+    dstk = *(int *)(c + 28);
+}
+
+/* pipelined mode: the lexer runs in its own thread and passes the
+   tokens to the parser in 'ring', a single producer, single consumer
+   ring. Only the lexer thread uses the lexer state and adds symbols;
+   the parser only reads the records of the tokens it gets. */
+lex_run(c)
+{
+    int w, r, t;
+
+    lex_load(c);
+    w = 0;
+    r = 0;
+    while (1) {
+        lex();
+        while (w - r == RING_SIZE) {
+            r = __atomic_load_n(&ring_rd, __ATOMIC_ACQUIRE);
+            if (w - r == RING_SIZE)
+                sched_yield();
+        }
+        t = ring + (w & (RING_SIZE - 1)) * 12;
+        *(int *)t = tok;
+        *(int *)(t + 4) = tokc;
+        *(int *)(t + 8) = tokl;
+        w++;
+        if (tok == -1)
+            lex_save(c); /* symbol count for the parser */
+        __atomic_store_n(&ring_wr, w, __ATOMIC_RELEASE);
+        if (tok == -1)
+            return 0;
+    }
+}
+
+/* read the next token of the lexer thread */
+ring_get()
+{
+    int t;
+
+    while (ring_rd == ring_lim) {
+        ring_lim = __atomic_load_n(&ring_wr, __ATOMIC_ACQUIRE);
+        if (ring_rd == ring_lim)
+            sched_yield();
+    }
+    t = ring + (ring_rd & (RING_SIZE - 1)) * 12;
+    tok = *(int *)t;
+    tokc = *(int *)(t + 4);
+    tokl = *(int *)(t + 8);
+    /* EOF is read again if needed */
+    if (tok != -1)
+        __atomic_store_n(&ring_rd, ring_rd + 1, __ATOMIC_RELEASE);
+    else
+        lex_load(lex_ctx);
+}
+
+/* start the lexer thread (after the first inp()) */
+lex_start()
+{
+    pthread_t th;
+
+    if (trd) {
+        /* everything comes from the token cache */
+        ring = 0;
+        return;
+    }
+    ring = malloc(RING_SIZE * 12);
+    lex_ctx = malloc(LEX_CTX);
+    lex_save(lex_ctx);
+    pthread_create(&th, 0, lex_run, lex_ctx);
+}
+
+/* start of a top level declaration after 'p': a line starting with
+   an identifier after a line "}" (end of a function), or fend. The
+   source is scanned from 't', the start of the chunk, skipping the
+   comments, strings and character constants as lex() does, so that
+   such lines inside them are not taken. */
+lex_split(t, p)
+{
+    int c;
+
+    while (t < fend) {
+        c = *(char *)t++;
+        if (c == '/' & t < fend && *(char *)t == '*') {
+            t = memmem(t + 1, fend - t - 1, "*/", 2);
+            if (!t)
+                return fend;
+            t = t + 2;
+        } else if (c == '\"') {
+            while (t < fend && *(char *)t != '\"') {
+                if (*(char *)t == '\\')
+                    t++;
+                t++;
+            }
+            t++;
+        } else if (c == '\'') {
+            if (t < fend && *(char *)t == '\\')
+                t++;
+            t = t + 2;
+        } else if (c == '\n' & t > p & t + 2 < fend &&
+                   *(char *)t == '}' & *(char *)(t + 1) == '\n') {
+            c = *(char *)(t + 2);
+            if (isalpha(c) | c == '_')
+                return t + 2;
+        }
+    }
+    return fend;
+}
+
+/* parallel lexing: thread lexing the chunk fptr..fend given in 'c'
+   with its own symbol table. The tokens are left in the token cache
+   format in c[8], with the symbols of the chunk table. */
+lex_chunk(c)
+{
+    lex_load(c);
+    /* names and define tokens take at most 17 bytes per source byte */
+    vars = arena((fend - fptr) * 8 + TOK_IDENT + 0x1000);
+    sym_hash = calloc(4, HASH_SIZE);
+    dstk = arena((fend - fptr) * 17 + 0x1000);
+    sym_cnt = 0;
+    sym_init();
+    tbuf = tptr = malloc(0x10000);
+    tend = tbuf + 0x10000;
+    inp();
+    while (1) {
+        lex();
+        tok_put();
+        if (tok == -1)
+            break;
+    }
+    lex_save(c);
+    *(int *)(c + 32) = tbuf;
+    return 0;
+}
+
+/* enter the symbols of a lexed chunk in the global table in order of
+   appearance, so that they are numbered as if lexed in one pass. c[9]
+   gives the global record of each chunk symbol. */
+lex_syms(c)
+{
+    int v, n, m, i;
+
+    v = *(int *)(c + 16);
+    n = *(int *)(c + 24);
+    m = malloc(n * 4);
+    i = 0;
+    while (i < n) {
+        last_id = *(int *)(v + TOK_IDENT + i * SYM_SIZE + 12);
+        *(int *)(m + i * 4) = vars + sym_find(strlen(last_id));
+        i++;
+    }
+    *(int *)(c + 36) = m;
+}
+
+/* the defines of a chunk are known once all its tokens are read:
+   they are copied to global define lists, with the global records of
+   their symbols. tok_get() expands them when they are used. */
+lex_defs(c)
+{
+    int v, n, m, e, i, d, a, t;
+
+    v = *(int *)(c + 16);
+    n = *(int *)(c + 24);
+    m = *(int *)(c + 36);
+    e = malloc(n * 4);
+    i = 0;
+    while (i < n) {
+        d = *(int *)(v + TOK_IDENT + i * SYM_SIZE + 8);
+        *(int *)(e + i * 4) = 0;
+        if (d) {
+            a = e + i * 4;
+            while (*(int *)d != -1) {
+                t = *(int *)d;
+                if (t > TOK_DEFINE)
+                    t = *(int *)(m + (t - v - TOK_IDENT) / SYM_SIZE * 4);
+                a = def_put(a, t, *(int *)(d + 4), *(int *)(d + 8));
+                d = *(int *)(d + 12);
+            }
+            def_put(a, -1, 0, 0);
+        }
+        i++;
+    }
+    /* now the defines of the chunk are known */
+    i = 0;
+    while (i < n) {
+        d = *(int *)(e + i * 4);
+        if (d) {
+            t = *(int *)(m + i * 4);
+            *(int *)(t + 8) = d;
+        }
+        i++;
+    }
+    free(e);
+}
+
+/* parallel lexing: for a large source, the chunks between top level
+   declarations are lexed by 'lex_jobs' threads. The parser then reads
+   them in order with tok_get(). */
+lex_par()
+{
+    int k, c, th, i, t, a, p;
+
+    if (trd)
+        return;
+    k = (fend - file) / LEX_CHUNK;
+    if (k > lex_jobs)
+        k = lex_jobs;
+    if (k < 2)
+        return;
+    c = calloc(k, LEX_CTX);
+    th = malloc(k * sizeof(pthread_t));
+    a = file;
+    i = 0;
+    while (i < k) {
+        t = c + i * LEX_CTX;
+        *(int *)(t + 4) = a;
+        a = fend;
+        if (i < k - 1) {
+            p = file + (fend - file) / k * (i + 1);
+            if (p < *(int *)(t + 4))
+                p = *(int *)(t + 4);
+            a = lex_split(*(int *)(t + 4), p);
+        }
+        *(int *)(t + 8) = a;
+        pthread_create(th + i * sizeof(pthread_t), 0, lex_chunk, t);
+        i++;
+    }
+    i = 0;
+    while (i < k) {
+        pthread_join(*(pthread_t *)(th + i * sizeof(pthread_t)), 0);
+        lex_syms(c + i * LEX_CTX);
+        i++;
+    }
+    tchunk = c;
+    tchunk_end = c + k * LEX_CTX;
+    trd = *(int *)(c + 32);
+    tmap = *(int *)(c + 36);
+}
+
+/* read a token from the token cache (tmap == 0), or from the chunks
+   of the parallel lexing (tmap: global records of the chunk symbols) */
+tok_get()
+{
+    int t, p;
+
+    while (1) {
+        if (def_next())
+            return;
+        p = trd;
+        t = *(int *)trd;
+        trd = trd + 4;
+        tokc = 0;
+        tokl = 0;
+        if (t & 1) {
+            tokc = *(int *)trd;
+            tokl = *(int *)(trd + 4);
+            trd = trd + 8;
+        }
+        tok = t >> 1;
+        if (tok == '\"')
+            tokc = tokc + file;
+        if (tok == -1) {
+            /* EOF is read again if needed */
+            trd = p;
+            if (!tmap)
+                return;
+            /* end of a chunk: go to the next one */
+            lex_defs(tchunk);
+            tchunk = tchunk + LEX_CTX;
+            tmap = 0;
+            if (tchunk < tchunk_end) {
+                trd = *(int *)(tchunk + 32);
+                tmap = *(int *)(tchunk + 36);
+            }
+        } else if (tok > TOK_DEFINE & !tmap) {
+            tok = tok + vars;
+            return;
+        } else if (tok > TOK_DEFINE) {
+            tok = *(int *)(tmap + (tok - TOK_IDENT) / SYM_SIZE * 4);
+            /* define of a previous chunk (the chunk lexer did not know
+               it) */
+            if (!def_expand())
+                return;
+        } else
+            return;
+    }
+}
+
+/* read the next token for the parser, and keep it if the token cache
+   is written */
+next()
+{
+    if (fc_rd) {
+        /* tokens of a function read by fc_load() */
+        tok = *(int *)fc_rd;
+        tokc = *(int *)(fc_rd + 4);
+        tokl = *(int *)(fc_rd + 8);
+        fc_rd = fc_rd + 12;
+        if (fc_rd == fc_tend)
+            fc_rd = 0;
+        return;
+    }
+    if (trd)
+        tok_get();
+    else if (ring)
+        ring_get();
+    else
+        lex();
+    if (tbuf)
+        tok_put();
+}
+
+/* function cache: the code of the functions is kept in the file
+   'functions' of the directory 'fc_dir' with a hash of their tokens. A
+   function found there is copied instead of being compiled, then its
+   uses of symbols and strings are patched and the values it gives to
+   its parameters and locals are set again. The functions of the
+   compilation are written in a new file which replaces the old one
+   at the end.
+
+   The code of a function only depends on its tokens and on the
+   symbols it uses before declaring them, because a local keeps its
+   stack offset in its record after the function. Their values are
+   hashed too when they are stack offsets.
+
+   format: magic, hash of FC_BUILD, then for each function: hash (2
+   words), size of the rest, code size, string data size, number of
+   records, the code (padded to 4 bytes), the string data, the
+   (kind, a, b) records and the hash of the entry from its code size:
+   kind 0: use of the symbol 'a' at code offset 'b'
+   kind 1: use of the string at data offset 'b' at code offset 'a'
+   kind 2: the symbol 'a' is set to 'b'
+   A symbol is saved as the index of its first token in the
+   function. */
+
+/* hash of the build of otccelfn */
+fc_build()
+{
+    return mem_hash(FC_BUILD, FC_BUILD + strlen(FC_BUILD));
+}
+
+/* check the function at 't' of the cache file ending at 'e': its
+   sizes and hash, and that its records are in its code and string
+   data. The symbol indices are checked by fc_syms() once the tokens
+   of the function are read. Return 0 if it cannot be used. */
+fc_check(t, e)
+{
+    int s, l, d, n, a, k, x, y;
+
+    if (t + 24 > e)
+        return 0;
+    s = *(int *)(t + 8);
+    l = *(int *)(t + 12);
+    d = *(int *)(t + 16);
+    n = *(int *)(t + 20);
+    if (s < 16 | s > e - t - 12 | l < 0 | l > s | d < 0 | d > s |
+        n < 0 | n > s / 12 || 16 + (l + 3 & -4) + d + n * 12 != s ||
+        mem_hash(t + 12, t + 8 + s) != *(int *)(t + 8 + s))
+        return 0;
+    a = t + 24 + (l + 3 & -4);
+    t = a + d;
+    while (n--) {
+        k = *(int *)t;
+        x = *(int *)(t + 4);
+        y = *(int *)(t + 8);
+        if (k == 1) {
+            if (x < 0 | x > l - 4 | y < 0 | y >= d ||
+                !memchr(a + y, 0, d - y))
+                return 0;
+        } else if (k < 0 | k > 2 | x < 0 | k == 0 & (y < 0 | y > l - 4))
+            return 0;
+        t = t + 12;
+    }
+    return 1;
+}
+
+/* return 1 if the symbol records of the cached function 'a' give
+   symbol tokens of the function read in fc_tok */
+fc_syms(a)
+{
+    int n, t, x;
+
+    n = *(int *)(a + 20);
+    t = a + 24 + (*(int *)(a + 12) + 3 & -4) + *(int *)(a + 16);
+    while (n--) {
+        x = *(int *)(t + 4);
+        if (*(int *)t != 1 &&
+            (x >= (fc_tend - fc_tok) / 12 ||
+             *(int *)(fc_tok + x * 12) <= TOK_DEFINE))
+            return 0;
+        t = t + 12;
+    }
+    return 1;
+}
+
+fc_init()
+{
+    int fd, n, a, t, e;
+
+    mkdir(fc_dir, 0777);
+    fc_path = malloc(strlen(fc_dir) + 20);
+    sprintf(fc_path, "%s/functions", fc_dir);
+    fc_new = malloc(strlen(fc_dir) + 20);
+    sprintf(fc_new, "%s/functions.new", fc_dir);
+    fc_tok = fc_tend = malloc(0x1000);
+    fc_tlim = fc_tok + 0x1000;
+    fc_rel = malloc(0x1000);
+    fc_rlim = fc_rel + 0x1000;
+
+    /* hash table of the functions of the previous compilation */
+    a = e = 0;
+    fd = open(fc_path, O_RDONLY);
+    if (fd >= 0) {
+        n = lseek(fd, 0, SEEK_END);
+        a = -1;
+        if (n >= FC_HEADER)
+            a = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (a != -1 && *(int *)a == FC_MAGIC &&
+            *(int *)(a + 4) == fc_build())
+            e = a + n;
+    }
+    /* the functions up to the first bad one are used */
+    n = 0;
+    t = a + FC_HEADER;
+    while (fc_check(t, e)) {
+        t = t + 12 + *(int *)(t + 8);
+        n++;
+    }
+    fc_old = fc_seq = a + FC_HEADER;
+    fc_oend = t;
+    fc_mask = 15;
+    while (fc_mask < n * 2)
+        fc_mask = fc_mask * 2 + 1;
+    fc_tab = calloc(4, fc_mask + 1);
+    t = a + FC_HEADER;
+    while (n--) {
+        fd = *(int *)t & fc_mask;
+        while (*(int *)(fc_tab + fd * 4))
+            fd = fd + 1 & fc_mask;
+        *(int *)(fc_tab + fd * 4) = t;
+        t = t + 12 + *(int *)(t + 8);
+    }
+}
+
+/* put 'n' bytes at 'a' in the new cache file. It is only written
+   from the first function which is not the next one of the old
+   file (fc_seq), so an unchanged source does not rewrite it. */
+fc_out(a, n)
+{
+    int h;
+
+    if (a == fc_seq) {
+        fc_seq = fc_seq + n;
+        return;
+    }
+    if (fc_seq != -1) {
+        fc_file = fopen(fc_new, "w");
+        if (fc_file) {
+            h = FC_MAGIC;
+            fwrite(&h, 4, 1, fc_file);
+            h = fc_build();
+            fwrite(&h, 4, 1, fc_file);
+            fwrite(fc_old, 1, fc_seq - fc_old, fc_file);
+        }
+        fc_seq = -1;
+    }
+    if (fc_file)
+        fwrite(a, 1, n, fc_file);
+}
+
+/* replace the old cache file (after a successful compilation) */
+fc_done()
+{
+    if (!fc_dir)
+        return;
+    /* functions removed at the end */
+    if (fc_seq != fc_oend)
+        fc_out(0, 0);
+    if (fc_file) {
+        fclose(fc_file);
+        rename(fc_new, fc_path);
+    }
+}
+
+/* append the current token to the tokens of the function */
+fc_put()
+{
+    int a;
+
+    if (fc_tend + 12 > fc_tlim) {
+        a = (fc_tlim - fc_tok) * 2;
+        fc_tend = fc_tend - fc_tok;
+        fc_tok = realloc(fc_tok, a);
+        fc_tend = fc_tend + fc_tok;
+        fc_tlim = fc_tok + a;
+    }
+    *(int *)fc_tend = tok;
+    *(int *)(fc_tend + 4) = tokc;
+    *(int *)(fc_tend + 8) = tokl;
+    fc_tend = fc_tend + 12;
+}
+
+/* record a (kind, a, b) entry if a function is being compiled */
+fc_rec(k, a, b)
+{
+    int n;
+
+    if (!fc_code)
+        return;
+    if (fc_rend + 12 > fc_rlim) {
+        n = (fc_rlim - fc_rel) * 2;
+        fc_rend = fc_rend - fc_rel;
+        fc_rel = realloc(fc_rel, n);
+        fc_rend = fc_rend + fc_rel;
+        fc_rlim = fc_rel + n;
+    }
+    *(int *)fc_rend = k;
+    *(int *)(fc_rend + 4) = a;
+    *(int *)(fc_rend + 8) = b;
+    fc_rend = fc_rend + 12;
+}
+
+/* add 'n' to the hash of the function */
+fc_hash(n)
+{
+    fc_h = (fc_h ^ n) * 0x01000193;
+    fc_g = (fc_g + n) * 0x5bd1e995;
+    fc_g = fc_g ^ fc_g >> 15;
+}
+
+/* hash the tokens of the function */
+fc_key()
+{
+    int t, v, s, d, n, c, l;
+
+    fc_h = 0x811c9dc5;
+    fc_g = 0;
+    /* the code depends on the register allocation */
+    if (opt)
+        fc_hash(-4);
+    /* the declared symbols are listed in the record buffer */
+    n = (fc_tend - fc_tok) / 3;
+    if (fc_rel + n > fc_rlim) {
+        fc_rel = realloc(fc_rel, n);
+        fc_rlim = fc_rel + n;
+    }
+    d = fc_rel;
+    n = 0;
+    c = 3; /* 3: header, 2: declaration, 1: declarations may follow '{'
+              or ';', 0: statements */
+    t = fc_tok;
+    while (t < fc_tend - 12) {
+        v = *(int *)t;
+        if (v > TOK_DEFINE) {
+            /* symbol: -2, name, -1 and -3, value if it is a stack
+               offset not set by the function */
+            fc_hash(-2);
+            s = *(int *)(v + 12);
+            while (*(char *)s)
+                fc_hash(*(char *)s++);
+            fc_hash(-1);
+            if (c >= 2) {
+                *(int *)(d + n * 4) = v;
+                n++;
+            } else {
+                l = 0;
+                while (l < n && *(int *)(d + l * 4) != v)
+                    l++;
+                s = *(int *)v;
+                if (l == n && s && s < LOCAL) {
+                    fc_hash(-3);
+                    fc_hash(s);
+                }
+            }
+        } else {
+            fc_hash(v);
+            if (v == '\"') {
+                /* string: same scan as in unary(), then -1 */
+                s = *(int *)(t + 4);
+                while (*(char *)s != '\"' & *(char *)s != 0) {
+                    if (*(char *)s == '\\')
+                        fc_hash(*(char *)s++ & 0xff);
+                    fc_hash(*(char *)s++ & 0xff);
+                }
+                fc_hash(-1);
+            } else if (v < TOK_IDENT) {
+                fc_hash(*(int *)(t + 4));
+                fc_hash(*(int *)(t + 8));
+            }
+        }
+        if (v == '{')
+            c = 1;
+        else if (c == 2) {
+            if (v == ';')
+                c = 1;
+        } else if (c == 1 & v == TOK_INT)
+            c = 2;
+        else if (c != 3)
+            c = 0;
+        t = t + 12;
+    }
+}
+
+/* read the tokens of the function which starts at the current token
+   in fc_tok, up to the token after it */
+fc_read()
+{
+    int d;
+
+    fc_tend = fc_tok;
+    d = 0;
+    while (1) {
+        fc_put();
+        if (tok == '{')
+            d++;
+        if (tok == '}') {
+            d--;
+            if (!d)
+                break;
+        }
+        if (tok == -1)
+            break;
+        next();
+    }
+    next();
+    fc_put();
+}
+
+/* make next() give the tokens read by fc_read() again */
+fc_again()
+{
+    tok = *(int *)fc_tok;
+    tokc = *(int *)(fc_tok + 4);
+    tokl = *(int *)(fc_tok + 8);
+    fc_rd = fc_tok + 12;
+}
+
+/* read the function which starts at the current token. If it is in
+   the cache, output its code, set the token after the function and
+   return 1. Otherwise, next() gives its tokens again to be compiled
+   and fc_save() saves it. */
+fc_load()
+{
+    int a, t, n, l, d, p, c;
+
+    fc_read();
+    fc_key();
+
+    /* find the function in the hash table */
+    t = fc_h & fc_mask;
+    while ((a = *(int *)(fc_tab + t * 4)) &&
+           (*(int *)a != fc_h | *(int *)(a + 4) != fc_g))
+        t = t + 1 & fc_mask;
+    if (a && fc_syms(a)) {
+        fc_out(a, 12 + *(int *)(a + 8));
+        l = *(int *)(a + 12);
+        d = *(int *)(a + 16);
+        n = *(int *)(a + 20);
+        a = a + 24;
+        memcpy(ind, a, l);
+        a = a + (l + 3 & -4);
+        t = a + d;
+        while (n--) {
+            c = *(int *)(t + 8);
+            if (*(int *)t == 1) {
+                /* add to the use list of the string */
+                p = str_find(a + c, strlen(a + c));
+                c = ind + *(int *)(t + 4);
+                put32(c, *(int *)(p + 4));
+                *(int *)(p + 4) = c;
+            } else {
+                p = *(int *)(fc_tok + *(int *)(t + 4) * 12);
+                if (*(int *)t == 0) {
+                    /* add to the use list of the symbol */
+                    put32(ind + c, *(int *)(p + 4));
+                    *(int *)(p + 4) = ind + c;
+                } else
+                    *(int *)p = c;
+            }
+            t = t + 12;
+        }
+        ind = ind + l;
+        tok = *(int *)(fc_tend - 12);
+        tokc = *(int *)(fc_tend - 8);
+        tokl = *(int *)(fc_tend - 4);
+        return 1;
+    }
+    fc_again();
+    fc_rend = fc_rel + 24;
+    fc_code = ind;
+    return 0;
+}
+
+/* write the function compiled since fc_load() in the new cache file */
+fc_save()
+{
+    int t, a, l, d, h;
+
+    d = 0;
+    t = fc_rel + 24;
+    while (t < fc_rend) {
+        if (*(int *)t == 1) {
+            *(int *)(t + 4) = *(int *)(t + 4) - fc_code;
+            d = d + *(int *)(*(int *)(t + 8) + 12) + 1;
+        } else {
+            a = fc_tok;
+            while (*(int *)a != *(int *)(t + 4))
+                a = a + 12;
+            *(int *)(t + 4) = (a - fc_tok) / 12;
+            if (*(int *)t == 0)
+                *(int *)(t + 8) = *(int *)(t + 8) - fc_code;
+        }
+        t = t + 12;
+    }
+    l = ind - fc_code + 3 & -4;
+    *(int *)fc_rel = fc_h;
+    *(int *)(fc_rel + 4) = fc_g;
+    *(int *)(fc_rel + 8) = fc_rend - fc_rel - 8 + l + d;
+    *(int *)(fc_rel + 12) = ind - fc_code;
+    *(int *)(fc_rel + 16) = d;
+    *(int *)(fc_rel + 20) = (fc_rend - fc_rel - 24) / 12;
+    fc_out(fc_rel, 24);
+    fc_out(fc_code, l);
+    h = hash_add(mem_hash(fc_rel + 12, fc_rel + 24), fc_code, fc_code + l);
+    /* the text of the strings */
+    d = 0;
+    t = fc_rel + 24;
+    while (t < fc_rend) {
+        if (*(int *)t == 1) {
+            a = *(int *)(t + 8);
+            fc_out(a + 16, *(int *)(a + 12) + 1);
+            h = hash_add(h, a + 16, a + 17 + *(int *)(a + 12));
+            *(int *)(t + 8) = d;
+            d = d + *(int *)(a + 12) + 1;
+        }
+        t = t + 12;
+    }
+    fc_out(fc_rel + 24, fc_rend - fc_rel - 24);
+    h = hash_add(h, fc_rel + 24, fc_rend);
+    fc_out(&h, 4);
+    fc_code = 0;
+}
+
 #ifdef TINY
 #define skip(c) next()
 #else
@@ -271,7 +1651,7 @@ void error(char *fmt,...)
     va_list ap;
 
     va_start(ap, fmt);
-    fprintf(stderr, "%d: ", ftell((FILE *)file));
+    fprintf(stderr, "%d: ", fptr - file);
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
     exit(1);
@@ -348,7 +1728,18 @@ gsym1(t, b)
 
 gsym(t)
 {
+    /* a jump to the next instruction is removed (-O) */
+    while (opt & t == ind - 4 & lsym != ind) {
+        if ((*(char *)(t - 1) & 255) == 0xe9)
+            ind = t - 1; /* jmp */
+        else if (*(char *)(t - 2) == 0x0f)
+            ind = t - 2; /* jcc */
+        else
+            break;
+        t = *(int *)t;
+    }
     gsym1(t, ind);
+    lsym = ind;
 }
 
 /* psym is used to put an instruction with a data field which is a
@@ -368,7 +1759,10 @@ oad(n, t)
 /* load immediate value */
 li(t)
 {
-    oad(0xb8, t); /* mov $xx, %eax */
+    if (opt & !t)
+        o(0xc031); /* xor %eax, %eax */
+    else
+        oad(0xb8, t); /* mov $xx, %eax */
 }
 
 gjmp(t)
@@ -386,10 +1780,18 @@ gtst(l, t)
 gcmp(t)
 {
     o(0xc139); /* cmp %eax,%ecx */
-    li(0);
+    gset(t);
+}
+
+/* set %eax to the condition 't' of the flags */
+gset(t)
+{
+    oad(0xb8, 0); /* mov $0, %eax, which keeps the flags */
     o(0x0f); /* setxx %al */
     o(t + 0x90);
     o(0xc0);
+    su_set = ind;
+    su_cc = t;
 }
 
 gmov(l, t)
@@ -397,31 +1799,170 @@ gmov(l, t)
     int n;
     o(l + 0x83);
     n = *(int *)t;
-    if (n && n < LOCAL)
-        oad(0x85, n);
-    else {
-        t = t + 4;
-        *(int *)t = psym(0x05, *(int *)t);
+    if (n && n < LOCAL && n & 3)
+        o(0xc0 + n); /* register */
+    else if (n && n < LOCAL)
+        glocal(0x85, n);
+    else
+        gref(0x05, t);
+}
+
+/* ModRM byte 'm' for 'n'(%ebp) with a 32 bit displacement, and the
+   displacement. With -O, a displacement which fits in a byte takes the
+   short form. */
+glocal(m, n)
+{
+    if (opt & n >= -128 & n < 128) {
+        o(m - 0x40);
+        *(char *)ind++ = n;
+    } else
+        oad(m, n);
+}
+
+/* sub (c = 0xec) or add (c = 0xc4) $n, %esp. With -O, nothing is
+   needed for zero and a byte is enough for a small 'n'. */
+gesp(c, n)
+{
+    if (opt & n < 128) {
+        if (n) {
+            o(0x83 + c * 0x100);
+            *(char *)ind++ = n;
+        }
+    } else
+        oad(0x81 + c * 0x100, n);
+}
+
+/* instruction 'n' with the address of the symbol 't', which is added
+   to its use list */
+gref(n, t)
+{
+    *(int *)(t + 4) = psym(n, *(int *)(t + 4));
+    fc_rec(0, t, ind - 4);
+}
+
+/* enter the string 't' of 'l' bytes in the string pool and return its
+   record (next in hash bucket, use list, offset in the pool, length,
+   text). 't' may be where a new record puts its text. */
+str_find(t, l)
+{
+    int h, a, p;
+
+    h = 0x811c9dc5;
+    a = t;
+    while (a < t + l)
+        h = (h ^ *(char *)a++ & 0xff) * 0x01000193;
+    p = str_hash + (h & (HASH_SIZE - 1)) * 4;
+    a = *(int *)p;
+    while (a) {
+        if (*(int *)(a + 12) == l && !memcmp(a + 16, t, l))
+            return a;
+        a = *(int *)a;
+    }
+    a = str_end;
+    memmove(a + 16, t, l);
+    *(char *)(a + 16 + l) = 0;
+    *(int *)a = *(int *)p;
+    *(int *)(a + 4) = 0;
+    *(int *)(a + 12) = l;
+    *(int *)p = a;
+    str_end = a + 16 + l + 4 & -4;
+    str_cnt++;
+    return a;
+}
+
+/* enter the string of the current token in the string pool */
+str_tok()
+{
+    int t, a, c;
+
+    a = str_end + 16;
+    t = tokc;
+    while (*(char *)t != '\"' & *(char *)t != 0) {
+        c = *(char *)t++;
+        if (c == '\\') {
+            c = *(char *)t++;
+            if (c == 'n')
+                c = '\n';
+        }
+        *(char *)a++ = c;
+    }
+    return str_find(str_end + 16, a - str_end - 16);
+}
+
+/* compare the strings of the records '*a' and '*b' from their end,
+   for a decreasing order */
+str_cmp(a, b)
+{
+    int i, j;
+
+    a = *(int *)a + 16;
+    b = *(int *)b + 16;
+    i = a + *(int *)(a - 4);
+    j = b + *(int *)(b - 4);
+    while (i > a & j > b) {
+        i--;
+        j--;
+        if (*(char *)i != *(char *)j)
+            return (*(char *)j & 0xff) - (*(char *)i & 0xff);
     }
+    return (j > b) - (i > a);
+}
+
+/* write the string pool at 'd', which is at address 'v' in the
+   program, patch the uses of the strings and return its size. A
+   string which ends another one shares its text: with the strings
+   sorted by str_cmp(), it comes just after a string it ends. */
+str_pool(d, v)
+{
+    int r, a, p, i, l, n, s;
+
+    r = malloc(str_cnt * 4 + 4);
+    a = str_buf;
+    i = 0;
+    while (a < str_end) {
+        *(int *)(r + i * 4) = a;
+        a = a + 16 + *(int *)(a + 12) + 4 & -4;
+        i++;
+    }
+    qsort(r, str_cnt, 4, str_cmp);
+    s = 0;
+    p = 0;
+    i = 0;
+    while (i < str_cnt) {
+        a = *(int *)(r + i * 4);
+        l = *(int *)(a + 12);
+        if (p && l <= *(int *)(p + 12) &&
+            !memcmp(p + 16 + *(int *)(p + 12) - l, a + 16, l)) {
+            *(int *)(a + 8) = *(int *)(p + 8) + *(int *)(p + 12) - l;
+        } else {
+            *(int *)(a + 8) = s;
+            memcpy(d + s, a + 16, l + 1);
+            s = s + l + 1;
+        }
+        p = a;
+        a = *(int *)(a + 4);
+        while (a) {
+            n = get32(a);
+            put32(a, v + *(int *)(p + 8));
+            a = n;
+        }
+        i++;
+    }
+    free(r);
+    return s;
 }
 
 /* l is one if '=' parsing wanted (quick hack) */
 unary(l)
 {
-    int n, t, a, c;
+    int n, t, a, b, c, d;
 
     n = 1; /* type of expression 0 = forward, 1 = value, other =
               lvalue */
     if (tok == '\"') {
-        li(glo + data_offset);
-        while (ch != '\"') {
-            getq();
-            *(char *)glo++ = ch;
-            inp();
-        }
-        *(char *)glo = 0;
-        glo = glo + 4 & -4; /* align heap */
-        inp();
+        a = str_tok();
+        *(int *)(a + 4) = oad(0xb8, *(int *)(a + 4)); /* mov $xx, %eax */
+        fc_rec(1, ind - 4, a);
         next();
     } else {
         c = tokl;
@@ -429,15 +1970,29 @@ unary(l)
         t = tok;
         next();
         if (t == TOK_NUM) {
-            li(a);
+            su_li(a);
         } else if (c == 2) {
             /* -, +, !, ~ */
+            b = ind;
             unary(0);
-            oad(0xb9, 0); /* movl $0, %ecx */
-            if (t == '!')
-                gcmp(a);
-            else
-                o(a);
+            if (opt & su_at == b & su_end == ind & su_k == 3) {
+                /* constant */
+                ind = b;
+                if (t == '-')
+                    su_li(-(unsigned)su_v);
+                else if (t == '!')
+                    su_li(!su_v);
+                else if (t == '~')
+                    su_li(~su_v);
+                else
+                    su_li(su_v);
+            } else {
+                oad(0xb9, 0); /* movl $0, %ecx */
+                if (t == '!')
+                    gcmp(a);
+                else
+                    o(a);
+            }
         } else if (t == '(') {
             expr();
             skip(')');
@@ -459,16 +2014,16 @@ unary(l)
             unary(0);
             if (tok == '=') {
                 next();
-                o(0x50); /* push %eax */
+                a = su_keep(11, 0);
                 expr();
-                o(0x59); /* pop %ecx */
+                su_take(a, 0);
                 o(0x0188 + (t == TOK_INT)); /* movl %eax/%al, (%ecx) */
             } else if (t) {
                 if (t == TOK_INT)
                     o(0x8b); /* mov (%eax), %eax */
                 else 
                     o(0xbe0f); /* movsbl (%eax), %eax */
-                ind++; /* add zero in code */
+                *(char *)ind++ = 0; /* zero displacement: the code may be rewritten */
             }
         } else if (t == '&') {
             gmov(10, tok); /* leal EA, %eax */
@@ -483,6 +2038,12 @@ unary(l)
             } else if (tok != '(') {
                 /* variable */
                 gmov(8, t); /* mov EA, %eax */
+                if (*(int *)t < LOCAL && *(int *)t & 3) {
+                    su_at = ind - 2;
+                    su_end = ind;
+                    su_k = 4;
+                    su_v = t;
+                }
                 if (tokl == 11) {
                     gmov(0, t);
                     o(tokc);
@@ -498,38 +2059,450 @@ unary(l)
             o(0x50); /* push %eax */
 
         /* push args and invert order */
-        a = oad(0xec81, 0); /* sub $xxx, %esp */
+        a = c = d = 0;
+        if (opt && fc_rd) {
+            /* the arguments go to the outgoing area of the frame, unless
+               something is pushed or a call after the first argument
+               would overwrite them. Else the stack is kept aligned at
+               the call. A function which is inlined makes no call, so
+               the area above what is pushed can take its arguments ('l'
+               is odd if a call follows the first one). */
+            l = su_args(fc_rd);
+            b = 0;
+            if (!n)
+                b = ra_find_inl(t);
+            if (b && *(int *)(b + 16) == l)
+                d = su_sp;
+            else if (n | su_sp | l & 1) {
+                l = l & -4;
+                c = l + (-(su_sp + (n != 0) * 4 + l) & 15);
+                su_sp = su_sp + c + (n != 0) * 4;
+                gesp(0xec, c); /* sub $xxx, %esp */
+            }
+        } else
+            a = oad(0xec81, 0); /* sub $xxx, %esp */
         next();
         l = 0;
         while(tok != ')') {
             expr();
-            oad(0x248489, l); /* movl %eax, xxx(%esp) */
+            if (opt & !(l + d))
+                o(0x240489); /* movl %eax, (%esp) */
+            else if (opt & l + d < 128) {
+                o(0x244489); /* movl %eax, xx(%esp) */
+                *(char *)ind++ = l + d;
+            } else
+                oad(0x248489, l + d); /* movl %eax, xxx(%esp) */
             if (tok == ',')
                 next();
             l = l + 4;
         }
-        put32(a, l);
-        next();
+        if (a) {
+            put32(a, l);
+            c = l;
+        }
         if (n) {
-            oad(0x2494ff, l); /* call *xxx(%esp) */
-            l = l + 4;
-        } else {
+            next();
+            oad(0x2494ff, c); /* call *xxx(%esp) */
+            c = c + 4;
+        } else if (!ra_inline(t, l, d)) {
+            next();
             /* forward reference */
-            t = t + 4;
-            *(int *)t = psym(0xe8, *(int *)t);
+            gref(0xe8, t);
+        }
+        if (c)
+            gesp(0xc4, c); /* add $xxx, %esp */
+        if (!a)
+            su_sp = su_sp - c;
+    }
+}
+
+/* expression temporaries (-O): instead of push %eax / pop %ecx around
+   the right operand of a binary operator, the left operand is kept in
+   a register when the tokens of the right operand show it is safe. In
+   Sethi-Ullman terms, a right operand which is a single constant or
+   variable (label 1) only needs %ecx. Otherwise, a left operand which
+   is a constant or a register variable is computed after the right
+   operand, and any other left operand waits in %edx if the right
+   operand does not use it (no call, no division). The stack is used
+   when %edx is already taken.
+
+   As the load of a constant is only emitted by su_li(), an operator
+   whose operands are both constants is computed by su_fold() and its
+   code replaced by the load of the result.
+
+   su_at..su_end: code of the last constant or register variable
+   loaded by unary(), su_k/su_v: how to load it in %ecx (3: constant
+   su_v, 4: register variable su_v), su_edx: %edx holds a temporary */
+
+/* size of the arguments of a call whose first one is the token 't',
+   plus 1 if an argument after the first one makes a call (-O) */
+su_args(t)
+{
+    int n, d, c;
+
+    n = d = c = 0;
+    if (*(int *)t != ')')
+        n = 4;
+    while (t < fc_tend) {
+        if (*(int *)t == '(') {
+            if (n > 4 && ra_call(t))
+                c = 1;
+            d++;
+        } else if (*(int *)t == ')') {
+            if (!d)
+                break;
+            d--;
+        } else if (*(int *)t == ',' & !d)
+            n = n + 4;
+        t = t + 12;
+    }
+    return n + c;
+}
+
+/* scan the operand of a binary operator of level 'l' (made of the
+   operators of lower levels) which starts at the current token. Return
+   0 if it is a single constant or variable, else 1, plus 2 if it uses
+   %edx (call or division), plus 4 if it changes the variable 'v'.
+   su_stop is the token after the operand. */
+su_scan(l, v)
+{
+    int t, p, c, d, e, r, n, u;
+
+    t = fc_rd - 12;
+    d = 0;
+    e = 1; /* an operand is expected */
+    r = 0;
+    n = 0;
+    u = 0; /* the last token is a unary '*' */
+    while (t < fc_tend) {
+        p = *(int *)t;
+        c = *(int *)(t + 8);
+        if (e) {
+            if (p == '(' & u) {
+                /* cast */
+                t = ra_paren(t);
+                n++;
+                u = 0;
+                continue;
+            }
+            u = p == '*';
+            if (p == '(')
+                d++;
+            else if (!(p == '*' | p == '&' | c == 2))
+                e = 0;
+        } else if (p == '(') {
+            /* call */
+            r = r | 2;
+            t = ra_paren(t);
+            n++;
+            continue;
+        } else if (p == TOK_DUMMY & c == 11) {
+            if (*(int *)(t - 12) == v)
+                r = r | 4;
+        } else if (p == '=') {
+            if (*(int *)(t - 12) == v)
+                r = r | 4;
+            if (!d)
+                l = 11; /* the assignment takes all the operators */
+            e = 1;
+        } else if (p == ')') {
+            if (!d)
+                break;
+            d--;
+        } else if (c >= 1 & c <= 10) {
+            if (!d & c >= l)
+                break;
+            if (p == '/' | p == '%')
+                r = r | 2;
+            e = 1;
+        } else if (!d)
+            break;
+        n++;
+        t = t + 12;
+    }
+    su_stop = t;
+    /* x, &x, x++ */
+    t = fc_rd - 12;
+    if (n == 1 | n == 2 & (*(int *)t == '&' |
+                           *(int *)(t + 12) == TOK_DUMMY &
+                           *(int *)(t + 20) == 11))
+        return r;
+    return r | 1;
+}
+
+/* keep %eax, the left operand of a binary operator, while its right
+   operand of level 'l' is computed. 'b' is where the code of the left
+   operand starts (0 if it cannot be loaded again). Return how it is
+   kept for su_take(). */
+su_keep(l, b)
+{
+    int r;
+
+    if (!opt | !fc_rd) {
+        o(0x50); /* push %eax */
+        su_sp = su_sp + 4;
+        return 0;
+    }
+    r = su_scan(l, su_v);
+    if (b && su_at == b & su_end == ind & !(r & 4)) {
+        /* the left operand is loaded again after the right one */
+        ind = b;
+        return su_k;
+    }
+    if (!r) {
+        o(0xc189); /* mov %eax, %ecx */
+        return 1;
+    }
+    if (!(r & 2) & !su_edx) {
+        su_edx = 1;
+        o(0xc289); /* mov %eax, %edx */
+        return 2;
+    }
+    o(0x50); /* push %eax */
+    su_sp = su_sp + 4;
+    return 0;
+}
+
+/* load the constant 'v' */
+su_li(v)
+{
+    su_at = ind;
+    li(v);
+    su_end = ind;
+    su_k = 3;
+    su_v = v;
+}
+
+/* compute the operator of token 'n' and code 't' on the constant 'a'
+   and the constant su_v whose load is the last code. Return 0 if it
+   must be done at run time. */
+su_fold(n, t, a)
+{
+    int b;
+
+    b = su_v;
+    if (n == '/' | n == '%') {
+        /* idiv faults */
+        if (!b | a == 0x80000000 & b == -1)
+            return 0;
+        if (n == '/')
+            a = a / b;
+        else
+            a = a % b;
+    } else if (n == '*') /* unsigned: no overflow, as on the target */
+        a = (unsigned)a * b;
+    else if (n == '+')
+        a = (unsigned)a + b;
+    else if (n == '-')
+        a = (unsigned)a - b;
+    else if (n == '&')
+        a = a & b;
+    else if (n == '^')
+        a = a ^ b;
+    else if (n == '|')
+        a = a | b;
+    else if (t == 0xe0d391) /* << */
+        a = (unsigned)a << (b & 31);
+    else if (t == 0xf8d391) /* >> */
+        a = a >> (b & 31);
+    else if (t == 4)
+        a = a == b;
+    else if (t == 5)
+        a = a != b;
+    else if (t == 0xc)
+        a = a < b;
+    else if (t == 0xd)
+        a = a >= b;
+    else if (t == 0xe)
+        a = a <= b;
+    else
+        a = a > b;
+    ind = su_at;
+    su_li(a);
+    return 1;
+}
+
+/* compute the operator of token 'n', code 't' and level 'l' on the
+   left operand kept as 'k' by su_keep() ('v' as for su_take()) and the
+   constant su_v whose load is the last code. The left operand stays in
+   %eax and the constant becomes an immediate operand. */
+su_imm(k, v, n, t, l)
+{
+    int a, b;
+
+    b = su_v;
+    ind = su_at;
+    su_at = 0;
+    if (k == 0) {
+        su_sp = su_sp - 4;
+        ind--; /* push %eax */
+    }
+    else if (k == 4)
+        o(0xc08b + *(int *)v * 0x100); /* mov %reg, %eax */
+    else {
+        ind = ind - 2; /* mov %eax, %ecx/%edx */
+        if (k == 2)
+            su_edx = 0;
+    }
+    if (n == '/' | n == '%')
+        su_div(n == '%', b);
+    else if (l == 3) {
+        if (b & 31) {
+            /* shl/sar $xx, %eax */
+            o(0xe0c1 + (t == 0xf8d391) * 0x1800);
+            *(char *)ind++ = b & 31;
+        }
+    } else if (n == '*')
+        su_mul(b);
+    else {
+        if (l == 4 | l == 5)
+            a = 7; /* cmp */
+        else
+            a = (t & 0xff) >> 3; /* add, or, and, sub, xor */
+        if (b >= -128 & b < 128) {
+            o(0xc083 + a * 0x800); /* op $xx, %eax */
+            *(char *)ind++ = b;
+        } else
+            oad(a * 8 + 5, b);
+        if (l == 4 | l == 5)
+            gset(t);
+    }
+}
+
+/* multiply %eax by the constant 'b' with a shift, an add or a lea
+   when one does it. */
+su_mul(b)
+{
+    int k;
+
+    k = 0;
+    while (k < 30 & 1 << k < b)
+        k++;
+    if (!b)
+        o(0xc031); /* xor %eax, %eax */
+    else if (b == -1)
+        o(0xd8f7); /* neg %eax */
+    else if (1 << k == b) {
+        if (k == 1)
+            o(0xc001); /* add %eax, %eax */
+        else if (k)
+            o(0xe0c1 + k * 0x10000); /* shl $k, %eax */
+    } else if (b == 3 | b == 5 | b == 9)
+        o(0x048d + (k - 1) * 0x400000); /* lea (%eax, %eax, b - 1), %eax */
+    else if (b >= -128 & b < 128) {
+        o(0xc06b); /* imul $xx, %eax, %eax */
+        *(char *)ind++ = b;
+    } else
+        oad(0xc069, b);
+}
+
+/* divide %eax by the constant 'b', or take the remainder if 'm', with
+   the rounding of idiv. Powers of two use shifts, the other divisors
+   a multiplication by 2^(31+k)/|b| + 1 (Granlund and Montgomery). */
+su_div(m, b)
+{
+    int a, i, k, q, r;
+
+    a = b;
+    if (a < 0 & a != 0x80000000)
+        a = -a;
+    if (a == 1) {
+        if (m)
+            o(0xc031); /* xor %eax, %eax */
+        else if (b < 0)
+            o(0xd8f7); /* neg %eax */
+        return;
+    }
+    if (a < 2 | a >= 0x40000000) {
+        /* 0, 0x80000000 and the largest divisors: keep idiv */
+        oad(0xb9, b); /* mov $xx, %ecx */
+        o(0xf9f799); /* cltd, idiv %ecx */
+        if (m)
+            o(0x92); /* xchg %edx, %eax */
+        return;
+    }
+    k = 0;
+    while (1 << k < a)
+        k++;
+    o(0xc189); /* mov %eax, %ecx */
+    if (1 << k == a) {
+        /* a negative dividend is rounded toward zero by adding a - 1 */
+        if (k > 1)
+            o(0x1ff9c1); /* sar $31, %ecx */
+        o(0xe9c1 + (32 - k) * 0x10000); /* shr $32 - k, %ecx */
+        o(0xc801); /* add %ecx, %eax */
+        if (m) {
+            if (a <= 128) {
+                o(0xe083); /* and $a - 1, %eax */
+                *(char *)ind++ = a - 1;
+            } else
+                oad(0x25, a - 1);
+            o(0xc829); /* sub %ecx, %eax */
+        } else
+            o(0xf8c1 + k * 0x10000); /* sar $k, %eax */
+    } else {
+        /* 2^(31 + k) / a, modulo 2^32, by long division */
+        q = 0;
+        r = 1;
+        i = k + 31;
+        while (i--) {
+            q = (unsigned)q * 2;
+            r = r * 2;
+            if (r >= a) {
+                q++;
+                r = r - a;
+            }
+        }
+        oad(0xb8, q + 1); /* mov $xx, %eax */
+        o(0xe9f7); /* imul %ecx */
+        o(0xca01); /* add %ecx, %edx */
+        if (k > 1)
+            o(0xfac1 + (k - 1) * 0x10000); /* sar $k - 1, %edx */
+        o(0xc889); /* mov %ecx, %eax */
+        o(0x1ff8c1); /* sar $31, %eax */
+        o(0xc229); /* sub %eax, %edx */
+        if (m) {
+            if (a < 128) {
+                o(0xc26b); /* imul $a, %edx, %eax */
+                *(char *)ind++ = a;
+            } else
+                oad(0xc269, a);
+            o(0xc129); /* sub %eax, %ecx */
+            o(0xc889); /* mov %ecx, %eax */
+            return;
         }
-        if (l)
-            oad(0xc481, l); /* add $xxx, %esp */
+        o(0xd089); /* mov %edx, %eax */
+    }
+    if (!m & b < 0)
+        o(0xd8f7); /* neg %eax */
+}
+
+/* put the left operand kept by su_keep() in %ecx. 'v' is su_v as it
+   was after su_keep(). */
+su_take(k, v)
+{
+    su_at = 0;
+    if (k == 0) {
+        su_sp = su_sp - 4;
+        o(0x59); /* pop %ecx */
     }
+    else if (k == 2) {
+        su_edx = 0;
+        o(0xd189); /* mov %edx, %ecx */
+    } else if (k == 3)
+        oad(0xb9, v); /* mov $xx, %ecx */
+    else if (k == 4)
+        o(0xc189 + *(int *)v * 0x800); /* mov %reg, %ecx */
 }
 
 sum(l)
 {
-    int t, n, a;
+    int t, n, a, b, c, e, v;
 
     if (l-- == 1)
         unary(1);
     else {
+        b = ind;
         sum(l);
         a = 0;
         while (l == tokl) {
@@ -541,9 +2514,20 @@ sum(l)
                 a = gtst(t, a); /* && and || output code generation */
                 sum(l);
             } else {
-                o(0x50); /* push %eax */
+                c = su_keep(l, b);
+                v = su_v;
+                e = ind;
                 sum(l);
-                o(0x59); /* pop %ecx */
+                if (opt & su_at == e & su_end == ind & su_k == 3) {
+                    /* constant right operand */
+                    if (c != 3) {
+                        su_imm(c, v, n, t, l);
+                        continue;
+                    }
+                    if (su_fold(n, t, v))
+                        continue;
+                }
+                su_take(c, v);
                 
                 if (l == 4 | l == 5) {
                     gcmp(t);
@@ -558,11 +2542,59 @@ sum(l)
         if (a && l > 8) {
             a = gtst(t, a);
             li(t ^ 1);
-            gjmp(5); /* jmp $ + 5 */
+            c = gjmp(0); /* jmp over li(t) */
             gsym(a);
             li(t);
+            gsym(c);
+        }
+    }
+}
+
+/* compile the condition of level 'l' (as sum()) with jumps (-O): add
+   to the chain 'a' a jump taken when the condition is 'j' (0: false,
+   1: true), and return the chain. && and || give no 0/1 value: an
+   operand which is 't' (0 for &&, 1 for ||) makes the condition 't',
+   so it jumps to 'a' if j == t, else to the end of the condition,
+   except the last operand which jumps to 'a' when it is 'j'. */
+su_cond(l, j, a)
+{
+    int b, c, t;
+
+    l--;
+    if (l < 9) {
+        b = ind;
+        su_set = 0;
+        sum(l + 1);
+        if (su_at == b & su_end == ind & su_k == 3) {
+            /* constant: no test */
+            ind = b;
+            if (!su_v == !j)
+                return gjmp(a);
+            return a;
+        }
+        if (su_set == ind) {
+            /* comparison: jump on its condition */
+            ind = ind - 8;
+            o(0x0f);
+            return psym(0x80 + (su_cc ^ !j), a);
         }
+        return gtst(j, a);
+    }
+    t = l - 9;
+    c = 0;
+    while (1) {
+        su_scan(l, 0);
+        if (*(int *)(su_stop + 8) != l)
+            break;
+        if (t == j)
+            a = su_cond(l, t, a);
+        else
+            c = su_cond(l, t, c);
+        next();
     }
+    a = su_cond(l, j, a);
+    gsym(c);
+    return a;
 }
 
 expr()
@@ -573,6 +2605,8 @@ expr()
 
 test_expr()
 {
+    if (opt && fc_rd)
+        return su_cond(11, 0, 0);
     expr();
     return gtst(0, 0);
 }
@@ -634,9 +2668,11 @@ block(l)
     } else {
         if (tok == TOK_RETURN) {
             next();
-            if (tok != ';')
-                expr();
-            rsym = gjmp(rsym); /* jmp */
+            if (!ra_tail()) {
+                if (tok != ';')
+                    expr();
+                rsym = gjmp(rsym); /* jmp */
+            }
         } else if (tok == TOK_BREAK) {
             next();
             *(int *)l = gjmp(*(int *)l);
@@ -646,6 +2682,522 @@ block(l)
     }
 }
 
+/* register allocation (-O): the tokens of a function are read before
+   it is compiled. The live range of each parameter and local goes from
+   its declaration to its last use, and is extended to the loops it
+   meets. A linear scan of the ranges puts the variables in ebx, esi
+   and edi, which the function saves, and leaves the others on the
+   stack. A variable whose address is taken stays on the stack.
+
+   ra_tab..ra_end: (symbol, start, end, register, uses, stack offset)
+   entries, the start and end being tokens of fc_tok. ra_lp..ra_lend:
+   (start, end) of the loops. A register is -1 if the variable cannot
+   be in a register. */
+
+/* add the variable 'v' declared at the token 's' */
+ra_var(v, s)
+{
+    int a;
+
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)a == v)
+            return;
+        a = a + 24;
+    }
+    *(int *)a = v;
+    *(int *)(a + 4) = s;
+    *(int *)(a + 8) = s;
+    *(int *)(a + 12) = 0;
+    *(int *)(a + 16) = 0;
+    *(int *)(a + 20) = 0;
+    ra_end = a + 24;
+}
+
+/* find the entry of the variable 'v' */
+ra_find(v)
+{
+    int a;
+
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)a == v)
+            return a;
+        a = a + 24;
+    }
+    return 0;
+}
+
+/* return the token after the parenthesis at token 't' */
+ra_paren(t)
+{
+    int d;
+
+    d = 0;
+    while (t < fc_tend) {
+        if (*(int *)t == '(')
+            d++;
+        t = t + 12;
+        if (*(int *)(t - 12) == ')' && !--d)
+            break;
+    }
+    return t;
+}
+
+/* the parenthesis at token 't' is a call: it follows a name, or a
+   parenthesis which does not end a cast */
+ra_call(t)
+{
+    int v;
+
+    v = *(int *)(t - 12);
+    return v > TOK_DEFINE | v == ')' & *(int *)(t - 24) != '*';
+}
+
+/* return the token after the statement at token 't', as block() parses
+   it. The declarations and the loops are listed. */
+ra_stmt(t)
+{
+    int v, a;
+
+    v = *(int *)t;
+    if (v == TOK_IF) {
+        t = ra_stmt(ra_paren(t + 12));
+        if (t < fc_tend && *(int *)t == TOK_ELSE)
+            t = ra_stmt(t + 12);
+    } else if (v == TOK_WHILE | v == TOK_FOR) {
+        a = t;
+        t = ra_stmt(ra_paren(t + 12));
+        *(int *)ra_lend = a;
+        *(int *)(ra_lend + 4) = t;
+        ra_lend = ra_lend + 8;
+    } else if (v == '{') {
+        t = t + 12;
+        while (t < fc_tend && *(int *)t == TOK_INT) {
+            t = t + 12;
+            while (t < fc_tend && *(int *)t != ';') {
+                if (*(int *)t > TOK_DEFINE)
+                    ra_var(*(int *)t, t);
+                if (*(int *)t != ',')
+                    ra_loc = ra_loc + 4;
+                t = t + 12;
+            }
+            t = t + 12;
+        }
+        while (t < fc_tend && *(int *)t != '}')
+            t = ra_stmt(t);
+        t = t + 12;
+    } else {
+        while (t < fc_tend && *(int *)t != ';')
+            t = t + 12;
+        t = t + 12;
+    }
+    return t;
+}
+
+/* order of the entries by start */
+ra_cmp(a, b)
+{
+    return *(int *)(a + 4) - *(int *)(b + 4);
+}
+
+/* choose the registers of the variables of the function in fc_tok */
+ra_scan()
+{
+    int t, a, b, v, n, r;
+
+    n = (fc_tend - fc_tok) / 12;
+    ra_tab = realloc(ra_tab, n * 32);
+    ra_end = ra_tab;
+    ra_lp = ra_lend = ra_tab + n * 24;
+    ra_used = ra_addr = 0;
+    ra_loc = 0;
+    ra_arg = su_args(fc_tok + 24);
+    /* the parameters are live from the entry */
+    t = fc_tok + 24;
+    while (t < fc_tend && *(int *)t != ')') {
+        if (*(int *)t != ',')
+            ra_var(*(int *)t, fc_tok);
+        t = t + 12;
+    }
+    ra_stmt(t + 12);
+
+    /* uses: a variable is used from its declaration. '&' is unary
+       when it does not follow an operand, which a cast is not. */
+    t = fc_tok + 24;
+    while (t < fc_tend - 12) {
+        a = ra_find(*(int *)t);
+        if (a && t > *(int *)(a + 4)) {
+            *(int *)(a + 8) = t;
+            *(int *)(a + 16) = *(int *)(a + 16) + 1;
+            v = *(int *)(t - 24);
+            if (*(int *)(t - 12) == '&' &
+                !(v > TOK_DEFINE | v == TOK_NUM | v == '\"' |
+                  v == ')' & *(int *)(t - 36) != '*')) {
+                *(int *)(a + 12) = -1;
+                ra_addr = 1;
+            }
+        }
+        t = t + 12;
+    }
+
+    /* extend the ranges to the loops they meet */
+    a = ra_tab;
+    while (a < ra_end) {
+        t = ra_lp;
+        while (t < ra_lend) {
+            if (*(int *)(a + 4) < *(int *)(t + 4) &
+                *(int *)(a + 8) >= *(int *)t) {
+                if (*(int *)t < *(int *)(a + 4))
+                    *(int *)(a + 4) = *(int *)t;
+                if (*(int *)(t + 4) > *(int *)(a + 8))
+                    *(int *)(a + 8) = *(int *)(t + 4);
+            }
+            t = t + 8;
+        }
+        /* a variable used once is not worth a register */
+        if (*(int *)(a + 16) < 2)
+            *(int *)(a + 12) = -1;
+        a = a + 24;
+    }
+    qsort(ra_tab, (ra_end - ra_tab) / 24, 24, ra_cmp);
+
+    /* linear scan: a variable takes a register which is free at its
+       start, or the one of the active variable which ends last if it
+       ends after it */
+    a = ra_tab;
+    while (a < ra_end) {
+        if (!*(int *)(a + 12)) {
+            v = 0;
+            n = 0x070603; /* ebx, esi, edi */
+            while (n) {
+                r = n & 255;
+                n = n >> 8;
+                t = ra_tab;
+                while (t < a && (*(int *)(t + 12) != r |
+                                 *(int *)(t + 8) < *(int *)(a + 4)))
+                    t = t + 24;
+                if (t == a) {
+                    *(int *)(a + 12) = r;
+                    break;
+                }
+                if (!v || *(int *)(t + 8) > *(int *)(v + 8))
+                    v = t;
+            }
+            if (!*(int *)(a + 12) && *(int *)(v + 8) > *(int *)(a + 8)) {
+                *(int *)(a + 12) = *(int *)(v + 12);
+                *(int *)(v + 12) = 0;
+            }
+            if (*(int *)(a + 12) > 0)
+                ra_used = ra_used | 1 << *(int *)(a + 12);
+        }
+        a = a + 24;
+    }
+
+    /* outgoing argument area for the largest call, padded so that
+       the stack is aligned at the calls: the return address, %ebp,
+       the locals and the saved registers are above it */
+    ra_out = n = 0;
+    t = fc_tok + 24;
+    while (t < fc_tend) {
+        if (*(int *)t == '(' && ra_call(t)) {
+            a = su_args(t + 12) & -4;
+            if (a > ra_out)
+                ra_out = a;
+            n = 1;
+        }
+        t = t + 12;
+    }
+    ra_esp = ra_loc;
+    r = 3;
+    while (r < 8) {
+        if (ra_used >> r & 1)
+            ra_esp = ra_esp + 4;
+        r++;
+    }
+    if (n)
+        ra_out = ra_out + (-(ra_esp + ra_out + 8) & 15);
+    ra_esp = ra_esp + ra_out;
+}
+
+/* inlining (-O): a function whose body is "{ return e; }", where 'e'
+   is short, makes no call, has no string and takes no address, keeps
+   its tokens. A later direct call of it stores its arguments as for
+   a call, then compiles 'e' with the parameters at the stack slots of
+   the arguments. A function is only inlined after its definition.
+   OTCC has no scopes: the other names of 'e' (globals) get back their
+   values in the function meanwhile, so that a local of the caller of
+   the same name does not change the meaning of 'e'.
+
+   ra_inl: hash table of (next, symbol, first token of 'e', token after
+   its ';', size of the parameters, number of other names, (parameter,
+   saved value)..., (name, value in the function, saved value)...) */
+
+/* keep the tokens of the function in fc_tok if it can be inlined */
+ra_keep()
+{
+    int t, e, a, p, n, v;
+
+    t = ra_paren(fc_tok + 12);
+    if (ra_addr | *(int *)t != '{' | *(int *)(t + 12) != TOK_RETURN)
+        return;
+    e = t + 24;
+    n = 0;
+    while (e < fc_tend && *(int *)e != ';') {
+        v = *(int *)e;
+        if (e >= t + 24 + INLINE_MAX * 12 | v == '\"' ||
+            v == '(' && ra_call(e))
+            return;
+        /* a name other than a parameter (the body has no locals) */
+        if (v > TOK_DEFINE && !ra_find(v)) {
+            if (!*(int *)v)
+                return; /* not defined yet */
+            n++;
+        }
+        e = e + 12;
+    }
+    if (e == t + 24 | e + 12 >= fc_tend || *(int *)(e + 12) != '}')
+        return;
+    if (!ra_inl)
+        ra_inl = calloc(4, 256);
+    a = malloc(24 + ra_arg * 2 + n * 12 + (e + 12 - t));
+    p = ra_inl + (*(int *)fc_tok >> 4 & 255) * 4;
+    *(int *)a = *(int *)p;
+    *(int *)p = a;
+    *(int *)(a + 4) = *(int *)fc_tok;
+    *(int *)(a + 16) = ra_arg;
+    /* the parameters */
+    p = a + 24;
+    v = fc_tok + 24;
+    while (*(int *)v != ')') {
+        if (*(int *)v != ',') {
+            *(int *)p = *(int *)v;
+            p = p + 8;
+        }
+        v = v + 12;
+    }
+    /* the other names with their values, once each */
+    v = t + 24;
+    while (v < e) {
+        if (*(int *)v > TOK_DEFINE && !ra_find(*(int *)v)) {
+            n = a + 24 + ra_arg * 2;
+            while (n < p && *(int *)n != *(int *)v)
+                n = n + 12;
+            if (n == p) {
+                *(int *)p = *(int *)v;
+                *(int *)(p + 4) = *(int *)*(int *)v;
+                p = p + 12;
+            }
+        }
+        v = v + 12;
+    }
+    *(int *)(a + 20) = (p - a - 24 - ra_arg * 2) / 12;
+    /* the tokens from '{', the first ones being looked behind */
+    memcpy(p, t, e + 12 - t);
+    *(int *)(a + 8) = p + 24;
+    *(int *)(a + 12) = p + (e + 12 - t);
+}
+
+/* entry of the function 't' in ra_inl, or 0 */
+ra_find_inl(t)
+{
+    int a;
+
+    if (!ra_inl)
+        return 0;
+    a = *(int *)(ra_inl + (t >> 4 & 255) * 4);
+    while (a && *(int *)(a + 4) != t)
+        a = *(int *)a;
+    return a;
+}
+
+/* compile the call of 't' whose 'l' bytes of arguments are 'd' bytes
+   above %esp and whose ')' is the current token inline if it can be.
+   Return 0 if nothing is done. */
+ra_inline(t, l, d)
+{
+    int a, p, e, f, r, v;
+
+    a = ra_find_inl(t);
+    if (!opt | !fc_rd | !a || *(int *)(a + 16) != l)
+        return 0;
+    e = a + 24 + l * 2;
+    f = e + *(int *)(a + 20) * 12;
+    /* the parameters take the slots of the arguments */
+    v = d - ra_esp - su_sp;
+    p = a + 24;
+    while (p < e) {
+        *(int *)(p + 4) = *(int *)*(int *)p;
+        *(int *)*(int *)p = v;
+        v = v + 4;
+        p = p + 8;
+    }
+    /* and the other names their values in the function, which a local
+       of the caller may hide */
+    while (p < f) {
+        *(int *)(p + 8) = *(int *)*(int *)p;
+        *(int *)*(int *)p = *(int *)(p + 4);
+        p = p + 12;
+    }
+    r = fc_rd;
+    v = fc_tend;
+    fc_rd = *(int *)(a + 8);
+    fc_tend = *(int *)(a + 12);
+    next();
+    expr();
+    fc_rd = r;
+    fc_tend = v;
+    next();
+    p = a + 24;
+    while (p < e) {
+        *(int *)*(int *)p = *(int *)(p + 4);
+        p = p + 8;
+    }
+    while (p < f) {
+        *(int *)*(int *)p = *(int *)(p + 8);
+        p = p + 12;
+    }
+    return 1;
+}
+
+/* set the value of the parameter or local 't' to the stack offset 'n',
+   or to its register */
+ra_set(t, n)
+{
+    int a;
+
+    *(int *)t = n;
+    a = ra_find(t);
+    if (a && *(int *)(a + 12) > 0) {
+        *(int *)(a + 20) = n;
+        *(int *)t = *(int *)(a + 12);
+    }
+}
+
+/* mov 'n'(%ebp), %reg 'r' */
+ra_load(r, n)
+{
+    o(0x8b);
+    glocal(0x85 + r * 8, n);
+}
+
+/* save the registers of the function and load its parameters which
+   are in registers */
+ra_enter()
+{
+    int a, r;
+
+    r = 3;
+    while (r < 8) {
+        if (ra_used >> r & 1)
+            o(0x50 + r); /* push %reg */
+        r++;
+    }
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)(a + 12) > 0 && *(int *)(a + 20) > 0)
+            ra_load(*(int *)(a + 12), *(int *)(a + 20));
+        a = a + 24;
+    }
+}
+
+/* restore the saved registers, which are under the locals */
+ra_restore()
+{
+    int r, n;
+
+    n = -ra_loc;
+    r = 3;
+    while (r < 8) {
+        if (ra_used >> r & 1) {
+            n = n - 4;
+            ra_load(r, n);
+        }
+        r++;
+    }
+}
+
+/* restore the saved registers and give back their stack offsets to
+   the variables */
+ra_leave()
+{
+    int a;
+
+    ra_restore();
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)(a + 20))
+            *(int *)*(int *)a = *(int *)(a + 20);
+        a = a + 24;
+    }
+    ra_end = ra_tab;
+    ra_used = 0;
+}
+
+/* compile "return f(...);" from the name 'f' as a jump if it can be
+   (-O). The arguments are pushed, then a call of the function itself
+   pops them into its parameters and jumps to ra_top, and another call
+   whose arguments fit in the parameters pops them there and jumps to
+   'f' once the frame is left. No address of a parameter or local must
+   live on. Return 0 if nothing is done. */
+ra_tail()
+{
+    int t, a, c, v, m;
+
+    t = tok;
+    if (!ra_top | ra_addr | !fc_rd | t <= TOK_DEFINE)
+        return 0;
+    if (*(int *)fc_rd != '(' || *(int *)ra_paren(fc_rd) != ';')
+        return 0;
+    a = su_args(fc_rd + 12);
+    m = t == *(int *)fc_tok;
+    if (a > ra_arg | a & 1 | m & a != ra_arg || ra_find_inl(t))
+        return 0;
+    next();
+    next();
+    a = 0;
+    while (tok != ')') {
+        expr();
+        o(0x50); /* push %eax */
+        su_sp = su_sp + 4;
+        a = a + 4;
+        if (tok == ',')
+            next();
+    }
+    next();
+    c = a;
+    while (a) {
+        a = a - 4;
+        su_sp = su_sp - 4;
+        v = a + 8;
+        if (m)
+            v = *(int *)*(int *)(fc_tok + 24 + a * 6);
+        if (a + 4 == c) {
+            /* the last argument is still in %eax */
+            ind--;
+            if (v & 3)
+                o(0xc089 + v * 0x100); /* mov %eax, %reg */
+            else {
+                o(0x89); /* mov %eax, xx(%ebp) */
+                glocal(0x85, v);
+            }
+        } else if (v & 3)
+            o(0x58 + v); /* pop %reg */
+        else {
+            o(0x8f); /* pop xx(%ebp) */
+            glocal(0x85, v);
+        }
+    }
+    if (m)
+        gjmp(ra_top - ind - 5);
+    else {
+        ra_restore();
+        o(0xc9); /* leave */
+        gref(0xe9, t);
+    }
+    return 1;
+}
+
 /* 'l' is true if local declarations */
 decl(l)
 {
@@ -657,7 +3209,8 @@ decl(l)
             while (tok != ';') {
                 if (l) {
                     loc = loc + 4;
-                    *(int *)tok = -loc;
+                    ra_set(tok, -loc);
+                    fc_rec(2, tok, -loc);
                 } else {
                     *(int *)tok = glo;
                     glo = glo + 4;
@@ -670,12 +3223,24 @@ decl(l)
         } else {
             /* put function address */
             *(int *)tok = ind;
+            if (fc_dir && fc_load())
+                continue;
+            if (opt) {
+                if (!fc_dir) {
+                    fc_read();
+                    fc_again();
+                }
+                ra_scan();
+                if (!fc_dir)
+                    ra_keep();
+            }
             next();
             skip('(');
             a = 8;
             while (tok != ')') {
                 /* read param name and compute offset */
-                *(int *)tok = a;
+                ra_set(tok, a);
+                fc_rec(2, tok, a);
                 a = a + 4;
                 next();
                 if (tok == ',')
@@ -684,11 +3249,26 @@ decl(l)
             next(); /* skip ')' */
             rsym = loc = 0;
             o(0xe58955); /* push   %ebp, mov %esp, %ebp */
-            a = oad(0xec81, 0); /* sub $xxx, %esp */
+            if (opt) {
+                /* the locals are known */
+                gesp(0xec, ra_loc); /* sub $xxx, %esp */
+                a = 0;
+            } else
+                a = oad(0xec81, 0); /* sub $xxx, %esp */
+            ra_enter();
+            if (opt) {
+                gesp(0xec, ra_out); /* sub $xxx, %esp */
+                ra_top = ind;
+            }
             block(0);
+            ra_top = 0;
             gsym(rsym);
+            ra_leave();
             o(0xc3c9); /* leave, ret */
-            put32(a, loc); /* save local variables */
+            if (a)
+                put32(a, loc); /* save local variables */
+            if (fc_dir)
+                fc_save();
         }
     }
 }
@@ -717,17 +3297,12 @@ elf_reloc(l)
     int t, a, n, p, b, c;
 
     p = 0;
-    t = sym_stk;
-    while (1) {
+    tok = vars + TOK_IDENT;
+    while (tok < vars + TOK_IDENT + sym_cnt * SYM_SIZE) {
         /* extract symbol name */
-        t++;
-        a = t;
-        while (*(char *)t != TAG_TOK && t < dstk)
-            t++;
-        if (t == dstk)
-            break;
+        a = *(int *)(tok + 12);
+        t = a + strlen(a);
         /* now see if it is forward defined */
-        tok = vars + (a - sym_stk) * 8 + TOK_IDENT - 8;
         b = *(int *)tok;
         n = *(int *)(tok + 4);
         if (n && b != 1) {
@@ -769,9 +3344,12 @@ elf_reloc(l)
                 gsym1(n, b);
             }
         }
+        tok = tok + SYM_SIZE;
     }
 }
 
+/* write the ELF file 'c'. Return the size of the image (built in the
+   data heap). */
 elf_out(c)
 {
     int glo_saved, dynstr, dynstr_size, dynsym, hash, rel, n, t, text_size;
@@ -783,7 +3361,14 @@ elf_out(c)
 
     /* add the startup code */
     ind = prog;
-    o(0x505458); /* pop %eax, push %esp, push %eax */
+    if (opt) {
+        /* call main with an aligned stack */
+        o(0xe18958); /* pop %eax, mov %esp, %ecx */
+        o(0xf0e483); /* and $-16, %esp */
+        o(0x08ec83); /* sub $8, %esp */
+        o(0x5051); /* push %ecx, push %eax */
+    } else
+        o(0x505458); /* pop %eax, push %esp, push %eax */
     t = *(int *)(vars + TOK_MAIN);
     oad(0xe8, t - ind - 5);
     o(0xc389);  /* movl %eax, %ebx */
@@ -830,11 +3415,15 @@ elf_out(c)
     /* relocation table */
     rel = glo;
     elf_reloc(2);
+    glo_saved = glo;
+
+    /* read only strings after the image. They are mapped one page
+       further so that they do not share a page of the image. */
+    str_bytes = str_pool(glo, glo + data_offset + 0x1000);
 
     /* copy code AFTER relocation is done */
     memcpy(text, prog, text_size);
 
-    glo_saved = glo;
     glo = data;
 
     /* elf header */
@@ -849,7 +3438,7 @@ elf_out(c)
     gle32(0);
     gle32(0);
     gle32(0x00200034);
-    gle32(3); /* phdr entry count */
+    gle32(4); /* phdr entry count */
 
     /* program headers */
     gle32(3); /* PT_INTERP */
@@ -861,6 +3450,15 @@ elf_out(c)
     gphdr1(0, glo_saved - data);
     gle32(7); /* PF_R | PF_X | PF_W */
     gle32(0x1000); /* align */
+
+    gle32(1); /* PT_LOAD */
+    gle32(glo_saved - data);
+    gle32(glo_saved + data_offset + 0x1000);
+    gle32(glo_saved + data_offset + 0x1000);
+    gle32(str_bytes);
+    gle32(str_bytes);
+    gle32(4); /* PF_R */
+    gle32(0x1000); /* align */
     
     gle32(2); /* PT_DYNAMIC */
     gphdr1(DYNAMIC_OFFSET, DYNAMIC_SIZE);
@@ -895,34 +3493,113 @@ elf_out(c)
     gle32(0);
 
     t = fopen(c, "w");
-    fwrite(data, 1, glo_saved - data, t);
+    fwrite(data, 1, glo_saved - data + str_bytes, t);
     fclose(t);
+    ind = prog + text_size;
+    return glo_saved - data + str_bytes;
 }
 #endif
 
+/* print the memory used by the compilation on stderr as 'key=value'
+   lines (--mem-stats). The buffers only grow, so this is also their
+   peak usage, except the data heap which is given by elf_out(). */
+mem_report(d)
+{
+    int a, t, m;
+
+    /* define tokens */
+    m = 0;
+    a = vars + TOK_IDENT;
+    while (a < vars + TOK_IDENT + sym_cnt * SYM_SIZE) {
+        t = *(int *)(a + 8);
+        while (t) {
+            m = m + 16;
+            if (*(int *)t == -1)
+                break;
+            t = *(int *)(t + 12);
+        }
+        a = a + SYM_SIZE;
+    }
+    fprintf(stderr, "sym_stk=%d\n", dstk - sym_stk);
+    fprintf(stderr, "vars=%d\n", TOK_IDENT + sym_cnt * SYM_SIZE);
+    fprintf(stderr, "data=%d\n", d);
+    fprintf(stderr, "code=%d\n", ind - prog);
+    fprintf(stderr, "symbols=%d\n", sym_cnt);
+    fprintf(stderr, "macro_bytes=%d\n", m);
+    fprintf(stderr, "string_bytes=%d\n", str_bytes);
+}
+
 main(n, t)
 {
+    while (n > 3 && *(char *)*(int *)(t + 4) == '-') {
+        t = t + 4;
+        n--;
+        if (!strcmp(*(int *)t, "-t")) {
+            t = t + 4;
+            n--;
+            tcache = *(int *)t;
+        } else if (!strcmp(*(int *)t, "-f")) {
+            t = t + 4;
+            n--;
+            fc_dir = *(int *)t;
+        } else if (!strcmp(*(int *)t, "-j"))
+            ring = 1;
+        else if (!strcmp(*(int *)t, "--mem-stats"))
+            mem_stats = 1;
+        else if (!strcmp(*(int *)t, "-O"))
+            opt = 1;
+        else if (!strncmp(*(int *)t, "-j", 2))
+            lex_jobs = atoi(*(int *)t + 2);
+        else
+            n = 0;
+    }
     if (n < 3) {
-        printf("usage: otccelf file.c outfile\n");
+        printf("usage: otccelf [-t cache] [-f dir] [-j] [-O] [--mem-stats] file.c outfile\n");
         return 0;
     }
-    dstk = strcpy(sym_stk = calloc(1, ALLOC_SIZE), 
-                  " int if else while break return for define main ") + TOK_STR_SIZE;
-    glo = data = calloc(1, ALLOC_SIZE);
-    ind = prog = calloc(1, ALLOC_SIZE);
-    vars = calloc(1, ALLOC_SIZE);
-
+    arena_next = ARENA_BASE;
+    dstk = sym_stk = arena(ARENA_SIZE);
+    vars = arena(ARENA_SIZE);
+    sym_hash = calloc(4, HASH_SIZE);
+    sym_init();
+    op_init();
+    glo = data = arena(ARENA_SIZE);
+    ind = prog = arena(ARENA_SIZE);
+    str_buf = str_end = arena(ARENA_SIZE);
+    str_hash = calloc(4, HASH_SIZE);
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        simd = 2;
+    else if (__builtin_cpu_supports("sse2"))
+        simd = 1;
     t = t + 4;
-    file = fopen(*(int *)t, "r");
+    src_load(*(int *)t);
 
     data_offset = ELF_BASE - data; 
     glo = glo + ELFSTART_SIZE;
-    ind = ind + STARTUP_SIZE;
-
+    ind = ind + STARTUP_SIZE + opt * 8;
+
+    if (tcache)
+        cache_open();
+    if (fc_dir)
+        fc_init();
+    else if (opt) {
+        fc_tok = fc_tend = malloc(0x1000);
+        fc_tlim = fc_tok + 0x1000;
+    }
     inp();
+    if (lex_jobs)
+        lex_par();
+    if (ring)
+        lex_start();
     next();
     decl(0);
+    cache_save();
+    fc_done();
     t = t + 4;
-    elf_out(*(int *)t);
+    n = elf_out(*(int *)t);
+    if (mem_stats)
+        mem_report(n);
     return 0;
 }
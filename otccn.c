@@ -23,6 +23,14 @@
 #include <stdarg.h>
 #endif
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <immintrin.h>
+#ifdef BENCH
+#include <time.h>
+#endif
 
 /* vars: value of variables 
    loc : local variable index
@@ -31,36 +39,107 @@
    rsym: return symbol
    prog: output code
    dstk: define stack
-   dptr, dch: macro state
+   sym_hash: identifier hash table
+   sym_cnt: number of symbols (records of SYM_SIZE bytes in vars)
+   op_tab: operator table, indexed by the first character
+   file: source text, fptr: read pointer, fend: end of source
+   dptr: define tokens being replayed, dexp..dexp_sp: defines being
+         expanded as (symbol, tokens after it), dexp_end: end of dexp
+   tcache: token cache file, tbuf/tptr/tend: token cache buffer
+   trd: tokens read (cache or chunks)
+   tmap: chunk symbols, tchunk/tchunk_end: chunks of parallel lexing
+   ring: lexer thread ring, ring_wr/ring_rd: tokens written/read
+   ring_lim: tokens known to be written (parser side)
+   lex_ctx: lexer thread state, lex_jobs: parallel lexing threads
+   arena_next: address of the next arena, data: start of glo
+   mem_stats: print the memory usage
+   simd: 2 if the processor has AVX2, 1 if it has SSE2, else 0
+   opt: optimize (-O), ra_tok..ra_tend: tokens of the current function
+         (ra_tlim: end of the buffer), ra_rd: tokens given again to
+         the parser, ra_tab..ra_end, ra_lp..ra_lend, ra_used, ra_loc:
+         register allocation of the current function (see ra_scan),
+         ra_out: size of its outgoing argument area, ra_arg: size of
+         its parameters, ra_addr: the address of a parameter or local
+         is taken, ra_top: code after its prologue, ra_esp: %esp is
+         %ebp - ra_esp in its body, ra_inl: hash table of the functions
+         which can be inlined (see ra_keep)
+   su_at, su_end, su_k, su_v, su_edx: expression temporaries (see
+         su_keep), su_sp: bytes pushed below the outgoing area
+   su_set: end of the code of the last comparison, su_cc: its
+         condition, su_stop: token after the operand seen by su_scan
+   lsym: last address given to gsym(), the jumps to it cannot be
+         removed
+   str_buf..str_end: string records (str_cnt strings), str_hash: their
+         hash table, str_bytes: size of the string pool
 */
-int tok, tokc, tokl, ch, vars, rsym, prog, ind, loc, glo, file, sym_stk, dstk, dptr, dch, last_id;
+/* each thread has its own token, lexer state and symbol table */
+__thread int tok, tokc, tokl, ch, fptr, fend, dptr, dexp, dexp_sp, dexp_end, last_id, vars, sym_hash, sym_cnt, dstk, tbuf, tptr, tend;
+int rsym, prog, ind, loc, glo, file, sym_stk, op_tab, tcache, trd, tmap, tchunk, tchunk_end, ring, ring_wr, ring_rd, ring_lim, lex_ctx, lex_jobs, arena_next, mem_stats, simd, str_buf, str_end, str_cnt, str_hash, str_bytes, opt, ra_tok, ra_tend, ra_tlim, ra_rd, ra_tab, ra_end, ra_lp, ra_lend, ra_used, ra_loc, ra_out, ra_arg, ra_addr, ra_top, ra_esp, ra_inl, su_at, su_end, su_k, su_v, su_edx, su_sp, su_set, su_cc, su_stop, lsym, data;
+
+/* address range reserved for each arena (sym_stk, vars, glo, prog
+   and str_buf): only the pages which are touched are allocated */
+#define ARENA_SIZE 0x8000000
+
+/* address range of all the arenas: the five fixed ones use 640 MB,
+   the rest is left for the -jN chunk tables (about 25 bytes per
+   source byte). Pointers stay positive. */
+#define ARENA_BASE 0x20000000
+#define ARENA_END  0x80000000
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* size of a huge page: the code after its first HUGE_SIZE bytes is
+   put in huge pages */
+#define HUGE_SIZE  0x200000
 
-#define ALLOC_SIZE 99999
+/* initial number of identifier hash table slots (must be a power of
+   two), also the number of string pool hash buckets */
+#define HASH_SIZE  0x10000
 
 /* depends on the init string */
-#define TOK_STR_SIZE 48
 #define TOK_IDENT    0x100
 #define TOK_INT      0x100
-#define TOK_IF       0x120
-#define TOK_ELSE     0x138
-#define TOK_WHILE    0x160
-#define TOK_BREAK    0x190
-#define TOK_RETURN   0x1c0
-#define TOK_FOR      0x1f8
-#define TOK_DEFINE   0x218
-#define TOK_MAIN     0x250
+#define TOK_IF       0x110
+#define TOK_ELSE     0x120
+#define TOK_WHILE    0x130
+#define TOK_BREAK    0x140
+#define TOK_RETURN   0x150
+#define TOK_FOR      0x160
+#define TOK_DEFINE   0x170
+#define TOK_MAIN     0x180
 
 #define TOK_DUMMY   1
 #define TOK_NUM     2
 
 #define LOCAL   0x200
 
+/* maximum number of tokens of the expression of an inlined function
+   (-O) */
+#define INLINE_MAX  24
+
 #define SYM_FORWARD 0
-#define SYM_DEFINE  1
+
+/* size of a symbol record in vars: value, use list, define text, name */
+#define SYM_SIZE    16
+
+/* token cache: header size and magic ("OTK2") */
+#define TC_HEADER   24
+#define TC_MAGIC    0x324b544f
+
+/* number of (tok, tokc, tokl) entries of the lexer ring (a power of
+   two) */
+#define RING_SIZE   4096
+
+/* size of a lexer state block (lex_save()) */
+#define LEX_CTX     40
+
+/* minimum size of a chunk for parallel lexing */
+#define LEX_CHUNK   0x100000
 
 /* tokens in string heap */
 #define TAG_TOK    ' '
-#define TAG_MACRO  2 /* STX, Start of Text */
 
 /*
  * pdef - 将字符写入定义栈（dstk）
@@ -76,32 +155,172 @@ pdef(t)
 }
 
 /*
- * inp - 字符输入函数，支持宏展开
- * 功能：从文件或宏定义中读取下一个字符，支持宏的递归展开
+ * inp - 字符输入函数
+ * 功能：从内存中的源代码读取下一个字符
  * 输入：无（使用全局变量）
  * 输出：无（结果存储在全局变量ch中）
  * 状态变化：
- *   - ch: 存储读取的字符
- *   - dptr: 如果从宏读取，指针向前移动；遇到宏结束标记时置0
- *   - dch: 宏展开时的保存字符
- * 主要逻辑：
- *   1. 如果dptr非空，从宏定义中读取字符
- *   2. 遇到TAG_MACRO标记时结束宏展开，恢复之前的字符
- *   3. 否则从文件中读取字符
+ *   - ch: 存储读取的字符，源代码结束时为-1
+ *   - fptr: 向前移动一个字符
+ * 主要逻辑：fptr未到达fend时读取一个字符，否则返回-1
+ *   （宏展开不经过这里，由next()直接重放记录的token）
  */
 inp()
 {
-    if (dptr) {
-        ch = *(char *)dptr++;
-        if (ch == TAG_MACRO) {
-            dptr = 0;
-            ch = dch;
-        }
-    } else
-        ch = fgetc(file);
+    if (fptr < fend)
+        ch = *(char *)fptr++ & 0xff;
+    else
+        ch = -1;
     /*    printf("ch=%c 0x%x\n", ch, ch); */
 }
 
+/*
+ * arena - 保留一块不会移动的内存
+ * 功能：保留n字节的地址空间，只有访问到的页才真正分配
+ * 输入：n - 大小
+ * 输出：内存地址（内容为0）
+ * 状态变化：arena_next前移（多个词法线程可以同时调用）
+ * 主要逻辑：
+ *   1. 从arena_next开始依次放置，全部在ARENA_END之下，保证地址为
+ *      正数（int比较）；超出时报告内存不足
+ *   2. 必须映射在指定地址（MAP_FIXED_NOREPLACE），否则报错退出
+ *   3. 内存不移动，回填的绝对地址一直有效
+ *   4. 后面紧跟一个不可访问的页，越界时立即出错而不是破坏其他数据
+ */
+arena(n)
+{
+    int a, h;
+
+    n = n + 0xfff & -0x1000;
+    h = __atomic_fetch_add(&arena_next, n + 0x1000, __ATOMIC_RELAXED);
+    if ((unsigned)h + n + 0x1000 > ARENA_END) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    a = mmap(h, n + 0x1000, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+             MAP_FIXED_NOREPLACE, -1, 0);
+    /* older kernels take the address as a hint only */
+    if (a != h) {
+        fprintf(stderr, "cannot map memory at 0x%x\n", h);
+        exit(1);
+    }
+    mprotect(a + n, 0x1000, PROT_NONE);
+    return a;
+}
+
+/*
+ * src_load - 将源文件整体读入内存
+ * 功能：用mmap()映射源文件，无法映射时（标准输入、管道）读入一个缓冲区
+ * 输入：t - 文件名，0表示标准输入
+ * 输出：无
+ * 状态变化：file指向源代码，fptr为读指针，fend为源代码结尾
+ * 主要逻辑：
+ *   1. 用lseek()取得文件大小，成功时映射整个文件
+ *      （文件大小为页大小的整数倍时不映射，保证文本后面总有一个0，
+ *       strtol()不会越界）
+ *   2. 否则用read()读入按需倍增的缓冲区，末尾补0
+ */
+src_load(t)
+{
+    int fd, n, l, a;
+
+    fd = 0;
+    if (t)
+        fd = open(t, O_RDONLY);
+    if (fd < 0) {
+        perror(t);
+        exit(1);
+    }
+    n = lseek(fd, 0, SEEK_END);
+    file = -1;
+    if (n > 0 & (n & (getpagesize() - 1)) != 0)
+        file = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == -1) {
+        lseek(fd, 0, SEEK_SET);
+        a = 0x10000;
+        n = 0;
+        file = malloc(a + 1);
+        while ((l = read(fd, file + n, a - n)) > 0) {
+            n = n + l;
+            if (n == a) {
+                a = a * 2;
+                file = realloc(file, a + 1);
+            }
+        }
+        *(char *)(file + n) = 0;
+    }
+    fptr = file;
+    fend = file + n;
+}
+
+/*
+ * skip_avx2 / skip_sse2 - 用AVX2/SSE2跳过空白字符
+ * 功能：每次比较32/16个字节，用movemask找到第一个非空白字符
+ * 输入：t - 源代码中的位置
+ * 输出：第一个非空白字符的位置，或最后一组完整字节之后的位置
+ * 主要逻辑：函数用target属性按AVX2/SSE2编译，与编译目标无关；
+ *           只有处理器支持时才调用（simd在main()中设置）
+ */
+__attribute__((target("avx2"))) skip_avx2(t)
+{
+    __m256i v, b;
+    int m;
+
+    while (t + 32 <= fend) {
+        v = _mm256_loadu_si256((__m256i *)t);
+        b = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+        b = _mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8(4)), b);
+        b = _mm256_or_si256(b, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        m = ~_mm256_movemask_epi8(b);
+        if (m)
+            return t + __builtin_ctz(m);
+        t = t + 32;
+    }
+    return t;
+}
+
+__attribute__((target("sse2"))) skip_sse2(t)
+{
+    __m128i v, b;
+    int m;
+
+    while (t + 16 <= fend) {
+        v = _mm_loadu_si128((__m128i *)t);
+        /* 9 <= c <= 13 or c == ' ' */
+        b = _mm_sub_epi8(v, _mm_set1_epi8(9));
+        b = _mm_cmpeq_epi8(_mm_min_epu8(b, _mm_set1_epi8(4)), b);
+        b = _mm_or_si128(b, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        m = ~_mm_movemask_epi8(b) & 0xffff;
+        if (m)
+            return t + __builtin_ctz(m);
+        t = t + 16;
+    }
+    return t;
+}
+
+/*
+ * skip_blanks - 跳过源代码中的一串空白字符
+ * 功能：在内存中的源代码里一次跳过多个空白字符（' '、'\t'、'\n'、
+ *       '\v'、'\f'、'\r'），不必每个字符调用一次inp()
+ * 输入：t - 源代码中的位置
+ * 输出：t之后第一个非空白字符的位置（或fend）
+ * 状态变化：无
+ * 主要逻辑：
+ *   1. 处理器支持AVX2/SSE2时每次比较32/16个字节（skip_avx2, skip_sse2）
+ *   2. 剩下不足一组的字节逐个检查
+ */
+skip_blanks(t)
+{
+    if (simd == 2)
+        t = skip_avx2(t);
+    if (simd)
+        t = skip_sse2(t);
+    while (t < fend && isspace(*(char *)t & 0xff))
+        t++;
+    return t;
+}
+
 /*
  * isid - 判断字符是否为标识符字符
  * 功能：检查当前字符是否可以作为标识符的一部分
@@ -135,7 +354,264 @@ getq()
 }
 
 /*
- * next - 词法分析器主函数
+ * sym_hval - 标识符的哈希值
+ * 输入：t - 标识符文本，l - 长度
+ * 输出：哈希值
+ */
+sym_hval(t, l)
+{
+    int h;
+
+    h = 0;
+    while (l--)
+        h = (h * 33 + *(char *)t++) & 0xffffff;
+    return h;
+}
+
+/*
+ * sym_size - 标识符哈希表的大小
+ * 输出：HASH_SIZE，一直加倍到大于符号个数的两倍
+ */
+sym_size()
+{
+    int m;
+
+    m = HASH_SIZE;
+    while (m <= sym_cnt * 2)
+        m = m * 2;
+    return m;
+}
+
+/*
+ * sym_grow - 扩大标识符哈希表
+ * 功能：把大小为m的哈希表中的标识符重新散列到两倍大小的新表中
+ * 输入：m - 原来的大小
+ * 输出：无
+ * 状态变化：sym_hash指向新表，原来的表被释放
+ */
+sym_grow(m)
+{
+    int a, p, h, t;
+
+    a = sym_hash;
+    sym_hash = calloc(8, m);
+    p = a;
+    while (p < a + m * 4) {
+        if (*(int *)p) {
+            t = *(int *)(vars + *(int *)p + 12);
+            h = sym_hval(t, strlen(t));
+            while (*(int *)(sym_hash + (h & m * 2 - 1) * 4))
+                h++;
+            *(int *)(sym_hash + (h & m * 2 - 1) * 4) = *(int *)p;
+        }
+        p = p + 4;
+    }
+    free(a);
+}
+
+/*
+ * sym_find - 在哈希表中查找（或加入）标识符
+ * 功能：取代对sym_stk的strstr()线性扫描，每种拼写只保存一次
+ * 输入：l - 标识符长度（标识符文本位于last_id，直接指向源代码或宏定义）
+ * 输出：标识符的token值（TOK_IDENT + SYM_SIZE * 符号编号）
+ * 状态变化：
+ *   - sym_hash, sym_cnt: 新标识符被编号并加入哈希表
+ *   - dstk: 只有新标识符的名字（以0结尾）被拷贝到dstk
+ *   - last_id: 指向该标识符唯一保存的拷贝
+ * 主要逻辑：
+ *   1. 计算标识符的哈希值，线性探测哈希表
+ *   2. 找到相同拼写时直接返回其token值
+ *   3. 否则分配下一个符号编号，把名字拷贝到sym_stk中
+ *   4. 表超过一半满时扩大为两倍（sym_grow）
+ */
+sym_find(l)
+{
+    int h, t, p, m;
+
+    m = sym_size();
+    h = sym_hval(last_id, l);
+    while (1) {
+        h = h & (m - 1);
+        p = *(int *)(sym_hash + h * 4);
+        if (!p)
+            break;
+        t = *(int *)(vars + p + 12);
+        if (!memcmp(t, last_id, l) & !*(char *)(t + l)) {
+            last_id = t;
+            return p;
+        }
+        h++;
+    }
+    /* first occurrence: keep a copy of the name */
+    p = sym_cnt++ * SYM_SIZE + TOK_IDENT;
+    *(int *)(sym_hash + h * 4) = p;
+    *(int *)(vars + p + 12) = dstk;
+    memcpy(dstk, last_id, l);
+    last_id = dstk;
+    dstk = dstk + l;
+    pdef(0);
+    /* keep the table at most half full */
+    if (sym_cnt * 2 == m)
+        sym_grow(m);
+    return p;
+}
+
+/*
+ * sym_init - 将关键字加入符号表
+ * 功能：按TOK_INT ... TOK_MAIN的顺序为关键字分配最前面的符号编号
+ * 输入：无
+ * 输出：无
+ * 状态变化：sym_stk, sym_hash, sym_cnt中加入所有关键字
+ * 主要逻辑：依次对每个关键字调用sym_find()
+ */
+sym_init()
+{
+    int t;
+
+    t = "int if else while break return for define main ";
+    while (*(char *)t) {
+        last_id = t;
+        while (*(char *)t != TAG_TOK)
+            t++;
+        sym_find(t - last_id);
+        t++;
+    }
+}
+
+/*
+ * op_init - 解码操作符表
+ * 功能：启动时把编码的操作符字符串解码一次，next()不再逐项解码
+ * 输入：无
+ * 输出：无
+ * 状态变化：op_tab指向256项的首字符表，后面是操作符项
+ * 主要逻辑：
+ *   1. 每项16字节：第二个字符（'@'表示单字符操作符）、tokc、tokl、
+ *      同一首字符的下一项
+ *   2. 按字符串中的顺序把每项接到其首字符链表的末尾，
+ *      保证匹配顺序与原来逐项扫描时相同
+ */
+op_init()
+{
+    int t, l, a, e;
+
+    op_tab = calloc(1, 256 * 4 + 32 * 16);
+    e = op_tab + 256 * 4;
+    t = "++#m--%am*@R<^1c/@%[_[H3c%@%[_[H3c+@.B#d-@%:_^BKd<<Z/03e>>`/03e<=0f>=/f<@.f>@1f==&g!=\'g&&k||#l&@.BCh^@.BSi|@.B+j~@/%Yd!@&d*@b";
+    while (l = *(char *)t++) {
+        *(int *)e = *(char *)t++;
+        tokc = 0;
+        while ((tokl = *(char *)t++ - 'b') < 0)
+            tokc = tokc * 64 + tokl + 64;
+        *(int *)(e + 4) = tokc;
+        *(int *)(e + 8) = tokl;
+        /* append to the list of 'l' */
+        a = op_tab + l * 4;
+        while (*(int *)a)
+            a = *(int *)a + 12;
+        *(int *)a = e;
+        e = e + 16;
+    }
+}
+
+/*
+ * def_put - 向宏定义的token链表追加一个token
+ * 功能：在定义栈中分配一个(tok, tokc, tokl, next)项并链接到a
+ * 输入：a - 链接的位置，t, c, l - token
+ * 输出：下一个token的链接位置
+ * 状态变化：dstk向前移动
+ */
+def_put(a, t, c, l)
+{
+    dstk = dstk + 3 & -4;
+    *(int *)a = dstk;
+    *(int *)dstk = t;
+    *(int *)(dstk + 4) = c;
+    *(int *)(dstk + 8) = l;
+    a = dstk + 12;
+    dstk = dstk + 16;
+    return a;
+}
+
+/*
+ * def_expand - 开始展开宏
+ * 功能：tok是宏名并且没有正在展开时，开始重放它的定义体
+ * 输入：无（使用tok）
+ * 输出：开始展开时返回1，否则返回0
+ * 状态变化：(tok, dptr)压入dexp栈，dptr指向定义体的token
+ * 主要逻辑：
+ *   1. 和原来一样在使用时展开：定义体中的宏名在重放时才展开，
+ *      因此可以使用后面才定义的宏
+ *   2. 正在展开的宏不再展开（与C相同），递归的宏不会死循环，
+ *      栈的深度不超过宏的个数
+ */
+def_expand()
+{
+    int t;
+
+    if (tok <= TOK_DEFINE || !*(int *)(tok + 8))
+        return 0;
+    t = dexp;
+    while (t < dexp_sp) {
+        if (*(int *)t == tok)
+            return 0;
+        t = t + 8;
+    }
+    if (dexp_sp == dexp_end) {
+        t = dexp_sp - dexp;
+        dexp = realloc(dexp, t * 2 + 64);
+        dexp_sp = dexp + t;
+        dexp_end = dexp + t * 2 + 64;
+    }
+    *(int *)dexp_sp = tok;
+    *(int *)(dexp_sp + 4) = dptr;
+    dexp_sp = dexp_sp + 8;
+    dptr = *(int *)(tok + 8);
+    return 1;
+}
+
+/*
+ * def_next - 读取正在展开的宏的下一个token
+ * 功能：重放dptr处的token，其中的宏名再展开
+ * 输入：无
+ * 输出：读到token时返回1，所有的宏都展开完时返回0
+ * 状态变化：dptr前移，定义体结束时从dexp栈取回它后面的token
+ */
+def_next()
+{
+    while (dptr) {
+        tok = *(int *)dptr;
+        if (tok == -1) {
+            dexp_sp = dexp_sp - 8;
+            dptr = *(int *)(dexp_sp + 4);
+        } else {
+            tokc = *(int *)(dptr + 4);
+            tokl = *(int *)(dptr + 8);
+            dptr = *(int *)(dptr + 12);
+            if (!def_expand())
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * lex - 词法分析器主函数
+ * 功能：读取下一个token并展开宏
+ * 输入：无
+ * 输出：无（结果存储在tok, tokc, tokl中）
+ * 状态变化：dptr, dexp_sp（见def_expand）
+ */
+lex()
+{
+    if (def_next())
+        return;
+    lex_src();
+    if (def_expand())
+        lex();
+}
+
+/*
+ * lex_src - 从源代码读取一个token
  * 功能：解析下一个token，处理标识符、数字、操作符、字符串、注释和预处理指令
  * 输入：无（使用全局变量）
  * 输出：无（结果存储在tok, tokc, tokl等全局变量中）
@@ -144,36 +620,46 @@ getq()
  *   - tokc: token的值（对于数字和操作符）
  *   - tokl: token的长度或优先级
  *   - last_id: 最后一个标识符的位置
- *   - dstk: 定义栈可能增长（存储标识符和宏定义）
+ *   - dstk: 定义栈可能增长（存储标识符和宏定义的token）
  * 主要逻辑：
- *   1. 跳过空白字符和处理预处理指令（#define）
- *   2. 识别标识符和数字
- *   3. 处理字符常量
+ *   1. 跳过空白字符和处理预处理指令：指令只分析到行尾，#define
+ *      的定义体被分析成(tok, tokc, tokl, next)链表保存，其中的宏名
+ *      不展开，其他指令被忽略
+ *   2. 识别标识符和数字（宏名由lex()展开）
+ *   3. 处理字符串（tokc指向源代码中的文本）和字符常量
  *   4. 处理注释
  *   5. 解析操作符（使用编码的操作符表）
- *   6. 支持宏展开
  */
-next()
+lex_src()
 {
     int t, l, a;
 
     while (isspace(ch) | ch == '#') {
         if (ch == '#') {
+            /* a directive is lexed up to the end of its line, where
+               lex_src() returns EOF */
+            l = fend;
+            t = memchr(fptr, '\n', fend - fptr);
+            if (t)
+                fend = t;
             inp();
-            next();
+            lex_src();
             if (tok == TOK_DEFINE) {
-                next();
-                pdef(TAG_TOK); /* fill last ident tag */
-                *(int *)tok = SYM_DEFINE;
-                *(int *)(tok + 4) = dstk; /* define stack */
-            }
-            /* well we always save the values ! */
-            while (ch != '\n') {
-                pdef(ch);
-                inp();
+                lex_src();
+                /* list of the define tokens, up to EOF. New names are
+                   stored in between. */
+                t = tok + 8;
+                while (tok != -1) {
+                    lex_src();
+                    t = def_put(t, tok, tokc, tokl);
+                }
             }
-            pdef(ch);
-            pdef(TAG_MACRO);
+            /* other directives are ignored */
+            fptr = fend;
+            fend = l;
+        } else {
+            /* skip the following blanks of the source at once */
+            fptr = skip_blanks(fptr);
         }
         inp();
     }
@@ -181,36 +667,35 @@ next()
     tok = ch;
     /* encode identifiers & numbers */
     if (isid()) {
-        pdef(TAG_TOK);
-        last_id = dstk;
+        /* the text is taken in place from the source */
+        last_id = fptr - 1;
+        l = 0;
         while (isid()) {
-            pdef(ch);
+            l++;
             inp();
         }
         if (isdigit(tok)) {
             tokc = strtol(last_id, 0, 0);
             tok = TOK_NUM;
         } else {
-            *(char *)dstk = TAG_TOK; /* no need to mark end of string (we
-                                        suppose data is initied to zero */
-            tok = strstr(sym_stk, last_id - 1) - sym_stk;
-            *(char *)dstk = 0;   /* mark real end of ident for dlsym() */
-            tok = tok * 8 + TOK_IDENT;
+            tok = sym_find(l);
             if (tok > TOK_DEFINE) {
                 tok = vars + tok;
                 /*        printf("tok=%s %x\n", last_id, tok); */
-                /* define handling */
-                if (*(int *)tok == SYM_DEFINE) {
-                    dptr = *(int *)(tok + 4);
-                    dch = ch;
-                    inp();
-                    next();
-                }
             }
         }
     } else {
         inp();
-        if (tok == '\'') {
+        if (tok == '\"') {
+            /* the text is decoded by the parser */
+            tokc = fptr - 1;
+            while (ch != '\"' & ch != -1) {
+                if (ch == '\\')
+                    inp();
+                inp();
+            }
+            inp();
+        } else if (tok == '\'') {
             tok = TOK_NUM;
             getq();
             tokc = ch;
@@ -219,26 +704,35 @@ next()
         } else if (tok == '/' & ch == '*') {
             inp();
             while (ch) {
-                while (ch != '*')
+                if (ch != '*') {
+                    /* go to the next '*' (memchr() is vectorized) */
+                    t = memchr(fptr, '*', fend - fptr);
+                    fptr = fend;
+                    if (t)
+                        fptr = t;
+                    inp();
+                }
+                while (ch != '*' & ch != -1)
                     inp();
                 inp();
-                if (ch == '/')
+                if (ch == '/' | ch == -1)
                     ch = 0;
             }
             inp();
-            next();
+            lex_src();
         } else
         {
-            t = "++#m--%am*@R<^1c/@%[_[H3c%@%[_[H3c+@.B#d-@%:_^BKd<<Z/03e>>`/03e<=0f>=/f<@.f>@1f==&g!=\'g&&k||#l&@.BCh^@.BSi|@.B+j~@/%Yd!@&d*@b";
-            while (l = *(char *)t++) {
-                a = *(char *)t++;
-                tokc = 0;
-                while ((tokl = *(char *)t++ - 'b') < 0)
-                    tokc = tokc * 64 + tokl + 64;
-                if (l == tok & (a == ch | a == '@')) {
+            tokc = 0;
+            /* EOF (-1) falls in the empty slot 255 */
+            t = *(int *)(op_tab + (tok & 255) * 4);
+            while (t) {
+                a = *(int *)t;
+                if (a == ch | a == '@') {
+                    tokc = *(int *)(t + 4);
+                    tokl = *(int *)(t + 8);
 #if 0
                     printf("%c%c -> tokl=%d tokc=0x%x\n", 
-                           l, a, tokl, tokc);
+                           tok, a, tokl, tokc);
 #endif
                     if (a == ch) {
                         inp();
@@ -246,6 +740,7 @@ next()
                     }
                     break;
                 }
+                t = *(int *)(t + 12);
             }
         }
     }
@@ -255,14 +750,11 @@ next()
 
         printf("tok=0x%x ", tok);
         if (tok >= TOK_IDENT) {
-            printf("'");
             if (tok > TOK_DEFINE) 
-                p = sym_stk + 1 + (tok - vars - TOK_IDENT) / 8;
+                p = tok;
             else
-                p = sym_stk + 1 + (tok - TOK_IDENT) / 8;
-            while (*(char *)p != TAG_TOK && *(char *)p)
-                printf("%c", *(char *)p++);
-            printf("'\n");
+                p = vars + tok;
+            printf("'%s'\n", *(int *)(p + 12));
         } else if (tok == TOK_NUM) {
             printf("%d\n", tokc);
         } else {
@@ -272,114 +764,754 @@ next()
 #endif
 }
 
-#ifdef TINY
-#define skip(c) next()
-#else
+/*
+ * tbuf_room - 保证token缓存缓冲区有足够空间
+ * 功能：确保tbuf中还能写入n个字节，不够时用realloc把缓冲区加倍
+ * 输入：n - 需要的字节数
+ * 输出：无
+ * 状态变化：tbuf、tptr、tend可能改变
+ */
+tbuf_room(n)
+{
+    int a;
+
+    if (tptr + n > tend) {
+        a = (tend - tbuf) * 2 + n;
+        n = tptr - tbuf;
+        tbuf = realloc(tbuf, a);
+        tptr = tbuf + n;
+        tend = tbuf + a;
+    }
+}
 
 /*
- * error - 错误处理函数
- * 功能：输出错误信息并终止程序
- * 输入：fmt - 格式化字符串，... - 可变参数
- * 输出：向stderr输出错误信息
- * 状态变化：程序终止（exit(1)）
- * 主要逻辑：
- *   1. 输出当前文件位置
- *   2. 格式化并输出错误信息
- *   3. 终止程序执行
+ * mem_hash - 计算一段内存的哈希值
+ * 功能：计算t到e的字节的FNV-1a哈希。整个源代码的哈希是token缓存的
+ *       键，缓存也用它检查自己的内容
+ * 输入：t - 开始，e - 结束
+ * 输出：32位哈希值
+ * 状态变化：无
  */
-void error(char *fmt,...)
+mem_hash(t, e)
 {
-    va_list ap;
+    int h;
 
-    va_start(ap, fmt);
-    fprintf(stderr, "%d: ", ftell((FILE *)file));
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
-    va_end(ap);
+    h = 0x811c9dc5;
+    while (t < e)
+        h = (h ^ *(char *)t++ & 0xff) * 0x01000193;
+    return h;
 }
 
 /*
- * skip - 跳过期望的字符token
- * 功能：检查当前token是否为期望的字符，如果是则读取下一个token，否则报错
- * 输入：c - 期望的字符
- * 输出：无
- * 状态变化：如果匹配，调用next()更新token状态；如果不匹配，程序终止
+ * cache_check - 检查token缓存
+ * 功能：使用缓存之前确认它由同一个源代码生成并且完整
+ * 输入：a - 映射的缓存文件，n - 文件大小
+ * 输出：可以使用时为1，否则为0
+ * 状态变化：无
  * 主要逻辑：
- *   1. 检查当前token是否等于期望字符
- *   2. 如果不匹配，调用error()报错并终止
- *   3. 如果匹配，调用next()读取下一个token
+ *   1. 检查文件头：魔数、源代码哈希和大小、文件其余部分的哈希，
+ *      符号名偏移在文件中
+ *   2. 符号名偏移之后有符号数个以'\0'结尾的名字
+ *   3. token在符号名之前以EOF结束，符号的token值小于符号数，
+ *      字符串的偏移在源代码中
  */
-void skip(c)
+cache_check(a, n)
 {
-    if (tok != c) {
-        error("'%c' expected", c);
+    int t, e, s, c;
+
+    if (n < TC_HEADER || *(int *)a != TC_MAGIC ||
+        *(int *)(a + 4) != mem_hash(file, fend) ||
+        *(int *)(a + 8) != fend - file ||
+        *(int *)(a + 20) != mem_hash(a + TC_HEADER, a + n))
+        return 0;
+    /* names */
+    s = *(int *)(a + 12);
+    c = *(int *)(a + 16);
+    if (c < TC_HEADER | c > n | s < 0)
+        return 0;
+    e = a + c;
+    t = e;
+    c = s;
+    while (c--) {
+        t = memchr(t, 0, a + n - t);
+        if (!t)
+            return 0;
+        t++;
     }
-    next();
+    /* tokens */
+    t = a + TC_HEADER;
+    while (t + 4 <= e) {
+        s = *(int *)t;
+        t = t + 4;
+        c = 0;
+        if (s & 1) {
+            if (t + 8 > e)
+                return 0;
+            c = *(int *)t;
+            t = t + 8;
+        }
+        s = s >> 1;
+        if (s == -1)
+            return 1;
+        if (s < 0 | s >= TOK_IDENT + *(int *)(a + 12) * SYM_SIZE |
+            s >= TOK_IDENT & (s & SYM_SIZE - 1) != 0 |
+            s == '\"' & (c < 1 | c > fend - file))
+            return 0;
+    }
+    return 0;
 }
 
-#endif
-
 /*
- * o - 输出机器码字节
- * 功能：将整数n的各个字节依次输出到代码缓冲区
- * 输入：n - 要输出的机器码（可能包含多个字节）
+ * cache_open - 打开token缓存
+ * 功能：如果缓存文件tcache是由同一个源代码生成的，就直接使用其中的
+ *       token，不再进行词法分析；否则准备在编译时记录token
+ * 输入：无（使用全局变量tcache、file、fend）
  * 输出：无
- * 状态变化：ind指针向前移动，代码缓冲区中添加字节
+ * 状态变化：
+ *   - 命中时：按原来的顺序加入符号，trd指向缓存中的token
+ *   - 未命中时：分配tbuf，tptr跳过文件头
  * 主要逻辑：
- *   1. 逐字节输出n的低位字节到代码缓冲区
- *   2. 将n右移8位处理下一个字节
- *   3. 直到n为0或-1时停止
+ *   1. 用mmap映射缓存文件，用cache_check()检查
+ *   2. 文件格式：魔数、哈希、源代码大小、符号数、符号名偏移、
+ *      文件其余部分的哈希、直到EOF的token、以'\0'结尾的符号名。每个token是tok * 2，
+ *      如果用到tokc和tokl则是tok * 2 + 1，后面跟着tokc和tokl
+ *   3. 符号保存为token值，字符串保存为在源代码中的偏移
  */
-o(n)
+cache_open()
 {
-    /* cannot use unsigned, so we must do a hack */
-    while (n && n != -1) {
-        *(char *)ind++ = n;
-        n = n >> 8;
+    int fd, n, a, t;
+
+    fd = open(tcache, O_RDONLY);
+    if (fd >= 0) {
+        n = lseek(fd, 0, SEEK_END);
+        a = -1;
+        if (n >= TC_HEADER)
+            a = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (a != -1 && cache_check(a, n)) {
+            /* enter the symbols in the same order */
+            n = *(int *)(a + 12);
+            t = a + *(int *)(a + 16);
+            while (n--) {
+                last_id = t;
+                t = t + strlen(t);
+                sym_find(t - last_id);
+                t++;
+            }
+            /* the tokens give symbol numbers: the names must differ */
+            if (sym_cnt != *(int *)(a + 12)) {
+                fprintf(stderr, "%s: corrupt token cache\n", tcache);
+                exit(1);
+            }
+            trd = a + TC_HEADER;
+            return;
+        }
+        if (a != -1)
+            munmap(a, n);
     }
+    tbuf = tptr = malloc(0x10000);
+    tend = tbuf + 0x10000;
+    tptr = tptr + TC_HEADER;
 }
 
 /*
- * gsym - 符号地址回填函数
- * 功能：回填符号的地址，解决前向引用问题
- * 输入：t - 需要回填的地址链表头
+ * cache_save - 写入token缓存
+ * 功能：编译成功后，把记录的token和符号名写入缓存文件tcache
+ * 输入：无
  * 输出：无
- * 状态变化：修改代码缓冲区中的地址引用
+ * 状态变化：填写tbuf中的文件头并追加符号名
  * 主要逻辑：
- *   1. 遍历需要回填的地址链表
- *   2. 计算相对地址（ind - t - 4）
- *   3. 将计算出的地址写回对应位置
- *   4. 处理链表中的下一个地址
+ *   1. 没有记录token（未使用缓存或缓存命中）时直接返回
+ *   2. 先写入tcache.tmp再rename()，缓存文件不会只写了一半
  */
-gsym(t)
+cache_save()
 {
-    int n;
-    while (t) {
-        n = *(int *)t; /* next value */
-        *(int *)t = ind - t - 4;
-        t = n;
+    int f, a, t, l;
+
+    if (!tbuf)
+        return;
+    *(int *)tbuf = TC_MAGIC;
+    *(int *)(tbuf + 4) = mem_hash(file, fend);
+    *(int *)(tbuf + 8) = fend - file;
+    *(int *)(tbuf + 12) = sym_cnt;
+    *(int *)(tbuf + 16) = tptr - tbuf;
+    a = vars + TOK_IDENT;
+    while (a < vars + TOK_IDENT + sym_cnt * SYM_SIZE) {
+        t = *(int *)(a + 12);
+        l = strlen(t) + 1;
+        tbuf_room(l);
+        memcpy(tptr, t, l);
+        tptr = tptr + l;
+        a = a + SYM_SIZE;
+    }
+    *(int *)(tbuf + 20) = mem_hash(tbuf + TC_HEADER, tptr);
+    /* a new file replaces the old one, which is never seen half
+       written */
+    a = malloc(strlen(tcache) + 5);
+    sprintf(a, "%s.tmp", tcache);
+    f = fopen(a, "w");
+    if (f) {
+        l = fwrite(tbuf, 1, tptr - tbuf, f) != tptr - tbuf;
+        if (fclose(f) | l)
+            remove(a);
+        else
+            rename(a, tcache);
     }
 }
 
-/* psym is used to put an instruction with a data field which is a
-   reference to a symbol. It is in fact the same as oad ! */
-#define psym oad
-
 /*
- * oad - 输出指令和地址
- * 功能：输出一个指令后跟一个4字节地址，用于需要地址操作数的指令
- * 输入：n - 指令码，t - 地址值
- * 输出：返回地址字段的位置
- * 状态变化：ind指针向前移动，代码缓冲区添加指令和地址
- * 主要逻辑：
- *   1. 调用o(n)输出指令码
- *   2. 在当前位置写入4字节地址
- *   3. 保存地址字段的位置
- *   4. ind向前移动4字节
- *   5. 返回地址字段位置供后续回填使用
+ * tok_put - 把当前token追加到token缓存缓冲区
+ * 功能：按缓存格式编码tok, tokc, tokl并写入tbuf
+ * 输入：无（使用tok, tokc, tokl）
+ * 输出：无
+ * 状态变化：tptr向前移动，tbuf可能扩大
  */
-oad(n, t)
+tok_put()
+{
+    int t, c;
+
+    tbuf_room(12);
+    t = tok;
+    if (t > TOK_DEFINE)
+        t = t - vars;
+    c = tokc;
+    if (tok == '\"')
+        c = c - file;
+    if (tok < TOK_IDENT & (c | tokl) != 0) {
+        *(int *)tptr = t * 2 + 1;
+        *(int *)(tptr + 4) = c;
+        *(int *)(tptr + 8) = tokl;
+        tptr = tptr + 12;
+    } else {
+        *(int *)tptr = t * 2;
+        tptr = tptr + 4;
+    }
+}
+
+/*
+ * lex_save/lex_load - 保存和恢复线程的词法分析状态
+ * 功能：ch, fptr, fend, dptr和符号表（vars, sym_hash, sym_cnt, dstk）
+ *       是每个线程独有的，通过LEX_CTX字节的块在线程之间传递
+ * 输入：c - 状态块
+ * 输出：无
+ */
+lex_save(c)
+{
+    *(int *)c = ch;
+    *(int *)(c + 4) = fptr;
+    *(int *)(c + 8) = fend;
+    *(int *)(c + 12) = dptr;
+    *(int *)(c + 16) = vars;
+    *(int *)(c + 20) = sym_hash;
+    *(int *)(c + 24) = sym_cnt;
+    *(int *)(c + 28) = dstk;
+}
+
+lex_load(c)
+{
+    ch = *(int *)c;
+    fptr = *(int *)(c + 4);
+    fend = *(int *)(c + 8);
+    dptr = *(int *)(c + 12);
+    vars = *(int *)(c + 16);
+    sym_hash = *(int *)(c + 20);
+    sym_cnt = *(int *)(c + 24);
+    dstk = *(int *)(c + 28);
+}
+
+/*
+ * lex_run - 词法分析线程
+ * 功能：流水线模式下在单独的线程中进行词法分析，把token写入环形
+ *       缓冲区ring，由语法分析线程读取（单生产者、单消费者）
+ * 输入：无
+ * 输出：无
+ * 状态变化：
+ *   - ring: 写入(tok, tokc, tokl)
+ *   - ring_wr: 已写入的token数（release写）
+ * 主要逻辑：
+ *   1. 调用lex()得到下一个token（宏展开也在这个线程中完成）
+ *   2. 环形缓冲区满时等待语法分析线程读取
+ *   3. 写入token后发布ring_wr，遇到EOF时结束
+ *   只有这个线程使用词法分析的状态和加入符号，语法分析线程只读取
+ *   它得到的token的符号记录
+ */
+lex_run(c)
+{
+    int w, r, t;
+
+    lex_load(c);
+    w = 0;
+    r = 0;
+    while (1) {
+        lex();
+        while (w - r == RING_SIZE) {
+            r = __atomic_load_n(&ring_rd, __ATOMIC_ACQUIRE);
+            if (w - r == RING_SIZE)
+                sched_yield();
+        }
+        t = ring + (w & (RING_SIZE - 1)) * 12;
+        *(int *)t = tok;
+        *(int *)(t + 4) = tokc;
+        *(int *)(t + 8) = tokl;
+        w++;
+        if (tok == -1)
+            lex_save(c); /* symbol count for the parser */
+        __atomic_store_n(&ring_wr, w, __ATOMIC_RELEASE);
+        if (tok == -1)
+            return 0;
+    }
+}
+
+/*
+ * ring_get - 从词法分析线程读取下一个token
+ * 功能：从环形缓冲区ring读取一个token到tok, tokc, tokl
+ * 输入：无
+ * 输出：无
+ * 状态变化：
+ *   - ring_lim: 已知写入的token数
+ *   - ring_rd: 已读取的token数（release写），EOF不前进，可以重复读取
+ */
+ring_get()
+{
+    int t;
+
+    while (ring_rd == ring_lim) {
+        ring_lim = __atomic_load_n(&ring_wr, __ATOMIC_ACQUIRE);
+        if (ring_rd == ring_lim)
+            sched_yield();
+    }
+    t = ring + (ring_rd & (RING_SIZE - 1)) * 12;
+    tok = *(int *)t;
+    tokc = *(int *)(t + 4);
+    tokl = *(int *)(t + 8);
+    /* EOF is read again if needed */
+    if (tok != -1)
+        __atomic_store_n(&ring_rd, ring_rd + 1, __ATOMIC_RELEASE);
+    else
+        lex_load(lex_ctx);
+}
+
+/*
+ * lex_start - 启动词法分析线程
+ * 功能：分配环形缓冲区并创建词法分析线程（在第一次inp()之后调用）
+ * 输入：无
+ * 输出：无
+ * 状态变化：ring被分配；如果token全部来自缓存则ring置0，不创建线程
+ */
+lex_start()
+{
+    pthread_t th;
+
+    if (trd) {
+        /* everything comes from the token cache */
+        ring = 0;
+        return;
+    }
+    ring = malloc(RING_SIZE * 12);
+    lex_ctx = malloc(LEX_CTX);
+    lex_save(lex_ctx);
+    pthread_create(&th, 0, lex_run, lex_ctx);
+}
+
+/*
+ * lex_split - 查找顶层声明的开始
+ * 功能：在p之后查找"}"行（函数结束）之后以标识符开头的行
+ * 输入：t - 代码块的开始，p - 开始查找的位置
+ * 输出：找到的位置，没有时返回fend
+ * 主要逻辑：从t开始扫描源代码，像lex()一样跳过注释、字符串和字符
+ *           常量，其中的"}"行不算
+ */
+lex_split(t, p)
+{
+    int c;
+
+    while (t < fend) {
+        c = *(char *)t++;
+        if (c == '/' & t < fend && *(char *)t == '*') {
+            t = memmem(t + 1, fend - t - 1, "*/", 2);
+            if (!t)
+                return fend;
+            t = t + 2;
+        } else if (c == '\"') {
+            while (t < fend && *(char *)t != '\"') {
+                if (*(char *)t == '\\')
+                    t++;
+                t++;
+            }
+            t++;
+        } else if (c == '\'') {
+            if (t < fend && *(char *)t == '\\')
+                t++;
+            t = t + 2;
+        } else if (c == '\n' & t > p & t + 2 < fend &&
+                   *(char *)t == '}' & *(char *)(t + 1) == '\n') {
+            c = *(char *)(t + 2);
+            if (isalpha(c) | c == '_')
+                return t + 2;
+        }
+    }
+    return fend;
+}
+
+/*
+ * lex_chunk - 并行词法分析线程
+ * 功能：用自己的符号表对c给出的源代码块fptr..fend进行词法分析
+ * 输入：c - 状态块
+ * 输出：无
+ * 状态变化：c中保存代码块的符号表，c[8]为token缓存格式的token
+ *           （符号是代码块符号表中的token）
+ */
+lex_chunk(c)
+{
+    lex_load(c);
+    /* 名字和define的token每个源代码字节最多占17字节 */
+    vars = arena((fend - fptr) * 8 + TOK_IDENT + 0x1000);
+    sym_hash = calloc(4, HASH_SIZE);
+    dstk = arena((fend - fptr) * 17 + 0x1000);
+    sym_cnt = 0;
+    sym_init();
+    tbuf = tptr = malloc(0x10000);
+    tend = tbuf + 0x10000;
+    inp();
+    while (1) {
+        lex();
+        tok_put();
+        if (tok == -1)
+            break;
+    }
+    lex_save(c);
+    *(int *)(c + 32) = tbuf;
+    return 0;
+}
+
+/*
+ * lex_syms - 把代码块的符号加入全局符号表
+ * 功能：按出现顺序加入符号，使符号编号与一次词法分析相同
+ * 输入：c - 代码块的状态块
+ * 输出：无
+ * 状态变化：c[9]为每个代码块符号对应的全局符号记录
+ */
+lex_syms(c)
+{
+    int v, n, m, i;
+
+    v = *(int *)(c + 16);
+    n = *(int *)(c + 24);
+    m = malloc(n * 4);
+    i = 0;
+    while (i < n) {
+        last_id = *(int *)(v + TOK_IDENT + i * SYM_SIZE + 12);
+        *(int *)(m + i * 4) = vars + sym_find(strlen(last_id));
+        i++;
+    }
+    *(int *)(c + 36) = m;
+}
+
+/*
+ * lex_defs - 登记代码块的宏定义
+ * 功能：代码块的token全部读完后，它的宏定义才生效：把宏定义的token
+ *       复制到全局链表，其中的符号换成全局符号记录（宏名在使用时由
+ *       tok_get()展开）
+ * 输入：c - 代码块的状态块
+ * 输出：无
+ * 状态变化：全局符号记录的值和宏定义链表
+ */
+lex_defs(c)
+{
+    int v, n, m, e, i, d, a, t;
+
+    v = *(int *)(c + 16);
+    n = *(int *)(c + 24);
+    m = *(int *)(c + 36);
+    e = malloc(n * 4);
+    i = 0;
+    while (i < n) {
+        d = *(int *)(v + TOK_IDENT + i * SYM_SIZE + 8);
+        *(int *)(e + i * 4) = 0;
+        if (d) {
+            a = e + i * 4;
+            while (*(int *)d != -1) {
+                t = *(int *)d;
+                if (t > TOK_DEFINE)
+                    t = *(int *)(m + (t - v - TOK_IDENT) / SYM_SIZE * 4);
+                a = def_put(a, t, *(int *)(d + 4), *(int *)(d + 8));
+                d = *(int *)(d + 12);
+            }
+            def_put(a, -1, 0, 0);
+        }
+        i++;
+    }
+    /* now the defines of the chunk are known */
+    i = 0;
+    while (i < n) {
+        d = *(int *)(e + i * 4);
+        if (d) {
+            t = *(int *)(m + i * 4);
+            *(int *)(t + 8) = d;
+        }
+        i++;
+    }
+    free(e);
+}
+
+/*
+ * lex_par - 并行词法分析
+ * 功能：源代码较大时在顶层声明之间分块，由lex_jobs个线程分别进行
+ *       词法分析，然后由tok_get()按顺序读取各个代码块
+ * 输入：无
+ * 输出：无
+ * 状态变化：trd、tmap指向第一个代码块，tchunk..tchunk_end为代码块
+ */
+lex_par()
+{
+    int k, c, th, i, t, a, p;
+
+    if (trd)
+        return;
+    k = (fend - file) / LEX_CHUNK;
+    if (k > lex_jobs)
+        k = lex_jobs;
+    if (k < 2)
+        return;
+    c = calloc(k, LEX_CTX);
+    th = malloc(k * sizeof(pthread_t));
+    a = file;
+    i = 0;
+    while (i < k) {
+        t = c + i * LEX_CTX;
+        *(int *)(t + 4) = a;
+        a = fend;
+        if (i < k - 1) {
+            p = file + (fend - file) / k * (i + 1);
+            if (p < *(int *)(t + 4))
+                p = *(int *)(t + 4);
+            a = lex_split(*(int *)(t + 4), p);
+        }
+        *(int *)(t + 8) = a;
+        pthread_create(th + i * sizeof(pthread_t), 0, lex_chunk, t);
+        i++;
+    }
+    i = 0;
+    while (i < k) {
+        pthread_join(*(pthread_t *)(th + i * sizeof(pthread_t)), 0);
+        lex_syms(c + i * LEX_CTX);
+        i++;
+    }
+    tchunk = c;
+    tchunk_end = c + k * LEX_CTX;
+    trd = *(int *)(c + 32);
+    tmap = *(int *)(c + 36);
+}
+
+/*
+ * tok_get - 从token缓存或并行词法分析的代码块读取token
+ * 功能：tmap为0时读取token缓存；否则读取代码块，tmap为代码块符号
+ *       对应的全局符号记录
+ * 输入：无
+ * 输出：无（结果存储在tok, tokc, tokl中）
+ * 主要逻辑：
+ *   1. 展开之前代码块的宏（代码块的词法分析线程不知道这些宏，见
+ *      def_expand）
+ *   2. 代码块结束时登记它的宏定义，转到下一个代码块
+ *   3. EOF可以重复读取
+ */
+tok_get()
+{
+    int t, p;
+
+    while (1) {
+        if (def_next())
+            return;
+        p = trd;
+        t = *(int *)trd;
+        trd = trd + 4;
+        tokc = 0;
+        tokl = 0;
+        if (t & 1) {
+            tokc = *(int *)trd;
+            tokl = *(int *)(trd + 4);
+            trd = trd + 8;
+        }
+        tok = t >> 1;
+        if (tok == '\"')
+            tokc = tokc + file;
+        if (tok == -1) {
+            /* EOF is read again if needed */
+            trd = p;
+            if (!tmap)
+                return;
+            /* end of a chunk: go to the next one */
+            lex_defs(tchunk);
+            tchunk = tchunk + LEX_CTX;
+            tmap = 0;
+            if (tchunk < tchunk_end) {
+                trd = *(int *)(tchunk + 32);
+                tmap = *(int *)(tchunk + 36);
+            }
+        } else if (tok > TOK_DEFINE & !tmap) {
+            tok = tok + vars;
+            return;
+        } else if (tok > TOK_DEFINE) {
+            tok = *(int *)(tmap + (tok - TOK_IDENT) / SYM_SIZE * 4);
+            /* define of a previous chunk */
+            if (!def_expand())
+                return;
+        } else
+            return;
+    }
+}
+
+/*
+ * next - 读取下一个token
+ * 功能：为语法分析器提供下一个token：来自ra_read()读入的函数、token
+ *       缓存或并行词法分析（tok_get）、词法分析线程（ring_get）或者lex()
+ * 输入：无
+ * 输出：无（结果存储在tok, tokc, tokl中）
+ * 状态变化：写token缓存时记录这个token
+ */
+next()
+{
+    if (ra_rd) {
+        /* ra_read()读入的函数token */
+        tok = *(int *)ra_rd;
+        tokc = *(int *)(ra_rd + 4);
+        tokl = *(int *)(ra_rd + 8);
+        ra_rd = ra_rd + 12;
+        if (ra_rd == ra_tend)
+            ra_rd = 0;
+        return;
+    }
+    if (trd)
+        tok_get();
+    else if (ring)
+        ring_get();
+    else
+        lex();
+    if (tbuf)
+        tok_put();
+}
+
+#ifdef TINY
+#define skip(c) next()
+#else
+
+/*
+ * error - 错误处理函数
+ * 功能：输出错误信息并终止程序
+ * 输入：fmt - 格式化字符串，... - 可变参数
+ * 输出：向stderr输出错误信息
+ * 状态变化：程序终止（exit(1)）
+ * 主要逻辑：
+ *   1. 输出当前文件位置
+ *   2. 格式化并输出错误信息
+ *   3. 终止程序执行
+ */
+void error(char *fmt,...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "%d: ", fptr - file);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+    va_end(ap);
+}
+
+/*
+ * skip - 跳过期望的字符token
+ * 功能：检查当前token是否为期望的字符，如果是则读取下一个token，否则报错
+ * 输入：c - 期望的字符
+ * 输出：无
+ * 状态变化：如果匹配，调用next()更新token状态；如果不匹配，程序终止
+ * 主要逻辑：
+ *   1. 检查当前token是否等于期望字符
+ *   2. 如果不匹配，调用error()报错并终止
+ *   3. 如果匹配，调用next()读取下一个token
+ */
+void skip(c)
+{
+    if (tok != c) {
+        error("'%c' expected", c);
+    }
+    next();
+}
+
+#endif
+
+/*
+ * o - 输出机器码字节
+ * 功能：将整数n的各个字节依次输出到代码缓冲区
+ * 输入：n - 要输出的机器码（可能包含多个字节）
+ * 输出：无
+ * 状态变化：ind指针向前移动，代码缓冲区中添加字节
+ * 主要逻辑：
+ *   1. 逐字节输出n的低位字节到代码缓冲区
+ *   2. 将n右移8位处理下一个字节
+ *   3. 直到n为0或-1时停止
+ */
+o(n)
+{
+    /* cannot use unsigned, so we must do a hack */
+    while (n && n != -1) {
+        *(char *)ind++ = n;
+        n = n >> 8;
+    }
+}
+
+/*
+ * gsym - 符号地址回填函数
+ * 功能：回填符号的地址，解决前向引用问题
+ * 输入：t - 需要回填的地址链表头
+ * 输出：无
+ * 状态变化：修改代码缓冲区中的地址引用
+ * 主要逻辑：
+ *   1. 遍历需要回填的地址链表
+ *   2. 计算相对地址（ind - t - 4）
+ *   3. 将计算出的地址写回对应位置
+ *   4. 处理链表中的下一个地址
+ *   5. -O时跳到下一条指令的跳转（链表头是最后的代码）被删除，除非
+ *      已经有跳转回填到这里（lsym）
+ */
+gsym(t)
+{
+    int n;
+    /* a jump to the next instruction is removed (-O) */
+    while (opt & t == ind - 4 & lsym != ind) {
+        if ((*(char *)(t - 1) & 255) == 0xe9)
+            ind = t - 1; /* jmp */
+        else if (*(char *)(t - 2) == 0x0f)
+            ind = t - 2; /* jcc */
+        else
+            break;
+        t = *(int *)t;
+    }
+    while (t) {
+        n = *(int *)t; /* next value */
+        *(int *)t = ind - t - 4;
+        t = n;
+    }
+    lsym = ind;
+}
+
+/* psym is used to put an instruction with a data field which is a
+   reference to a symbol. It is in fact the same as oad ! */
+#define psym oad
+
+/*
+ * oad - 输出指令和地址
+ * 功能：输出一个指令后跟一个4字节地址，用于需要地址操作数的指令
+ * 输入：n - 指令码，t - 地址值
+ * 输出：返回地址字段的位置
+ * 状态变化：ind指针向前移动，代码缓冲区添加指令和地址
+ * 主要逻辑：
+ *   1. 调用o(n)输出指令码
+ *   2. 在当前位置写入4字节地址
+ *   3. 保存地址字段的位置
+ *   4. ind向前移动4字节
+ *   5. 返回地址字段位置供后续回填使用
+ */
+oad(n, t)
 {
     o(n);
     *(int *)ind = t;
@@ -398,7 +1530,10 @@ oad(n, t)
  */
 li(t)
 {
-    oad(0xb8, t); /* mov $xx, %eax */
+    if (opt & !t)
+        o(0xc031); /* xor %eax, %eax */
+    else
+        oad(0xb8, t); /* mov $xx, %eax */
 }
 
 /*
@@ -438,16 +1573,28 @@ gtst(l, t)
  * 状态变化：代码缓冲区添加比较指令序列，EAX被设置为比较结果
  * 主要逻辑：
  *   1. 生成"cmp %eax, %ecx"指令
- *   2. 将EAX清零
- *   3. 根据比较结果用setxx指令设置AL（EAX的低8位）
+ *   2. 用gset()根据标志设置EAX
  */
 gcmp(t)
 {
     o(0xc139); /* cmp %eax,%ecx */
-    li(0);
+    gset(t);
+}
+
+/*
+ * gset - 根据标志设置EAX为0或1
+ * 输入：t - 比较类型（setxx指令的操作码）
+ * 状态变化：将EAX清零，再用setxx指令设置AL（EAX的低8位），在su_set和
+ *           su_cc中记录这段代码的结尾和条件
+ */
+gset(t)
+{
+    oad(0xb8, 0); /* mov $0, %eax, which keeps the flags */
     o(0x0f); /* setxx %al */
     o(t + 0x90);
     o(0xc0);
+    su_set = ind;
+    su_cc = t;
 }
 
 /*
@@ -460,48 +1607,220 @@ gcmp(t)
  *   1. 生成基础指令码（l + 0x83）
  *   2. 根据变量是否为局部变量选择寻址模式
  *   3. 局部变量使用EBP相对寻址，全局变量使用绝对寻址
+ *   4. -O时放在寄存器中的变量（值为寄存器号）直接使用寄存器
  */
 gmov(l, t)
 {
     o(l + 0x83);
-    oad((t < LOCAL) << 7 | 5, t);
+    if (t < LOCAL && t & 3)
+        o(0xc0 + t); /* register */
+    else if (t < LOCAL)
+        glocal(0x85, t);
+    else
+        oad(5, t);
 }
 
 /*
- * unary - 解析一元表达式
- * 功能：解析一元表达式，包括常量、变量、函数调用、指针操作等
- * 输入：l - 是否允许赋值操作（1表示允许）
- * 输出：无（结果在EAX寄存器中）
- * 状态变化：
- *   - 代码缓冲区添加相应指令
- *   - 可能修改glo（全局数据指针）
- *   - 可能调用next()更新token状态
- * 主要逻辑：
- *   1. 处理字符串字面量（存储到全局数据区）
- *   2. 处理数字常量（加载到EAX）
- *   3. 处理一元运算符（-, +, !, ~）
- *   4. 处理括号表达式
- *   5. 处理指针解引用和类型转换
- *   6. 处理取地址操作（&）
- *   7. 处理变量访问和赋值
- *   8. 处理函数调用（参数压栈、调用、清理栈）
+ * glocal - 输出局部变量'n'(%ebp)的ModRM字节和偏移
+ * 输入：m - 32位偏移形式的ModRM字节，n - 偏移
+ * 状态变化：代码缓冲区添加ModRM字节和偏移，-O时偏移能放进一个字节的
+ *           用8位偏移的形式
  */
-unary(l)
+glocal(m, n)
 {
-    int n, t, a, c;
+    if (opt & n >= -128 & n < 128) {
+        o(m - 0x40);
+        *(char *)ind++ = n;
+    } else
+        oad(m, n);
+}
 
-    n = 1; /* type of expression 0 = forward, 1 = value, other =
-              lvalue */
-    if (tok == '\"') {
-        li(glo);
-        while (ch != '\"') {
-            getq();
-            *(char *)glo++ = ch;
-            inp();
+/*
+ * gesp - 生成sub（c = 0xec）或add（c = 0xc4）$n, %esp
+ * 输入：c - 指令的ModRM字节，n - 字节数
+ * 状态变化：代码缓冲区添加指令，-O时n为0没有指令，n较小时用8位立即数
+ */
+gesp(c, n)
+{
+    if (opt & n < 128) {
+        if (n) {
+            o(0x83 + c * 0x100);
+            *(char *)ind++ = n;
         }
-        *(char *)glo = 0;
-        glo = glo + 4 & -4; /* align heap */
-        inp();
+    } else
+        oad(0x81 + c * 0x100, n);
+}
+
+/*
+ * str_find - 在字符串池中查找或加入字符串
+ * 功能：相同的字符串字面量只保存一次
+ * 输入：t - 字符串内容（可以已经位于新记录的位置str_end + 16）
+ *       l - 字节数
+ * 输出：字符串记录（桶内下一个记录、使用链表、池中偏移、长度、内容）
+ * 状态变化：新字符串加入str_buf, str_hash，str_end和str_cnt增加
+ * 主要逻辑：
+ *   1. 用FNV哈希在str_hash中查找相同的字符串
+ *   2. 找不到时在str_end建立记录，内容以0结尾，按4字节对齐
+ */
+str_find(t, l)
+{
+    int h, a, p;
+
+    h = 0x811c9dc5;
+    a = t;
+    while (a < t + l)
+        h = (h ^ *(char *)a++ & 0xff) * 0x01000193;
+    p = str_hash + (h & (HASH_SIZE - 1)) * 4;
+    a = *(int *)p;
+    while (a) {
+        if (*(int *)(a + 12) == l && !memcmp(a + 16, t, l))
+            return a;
+        a = *(int *)a;
+    }
+    a = str_end;
+    memmove(a + 16, t, l);
+    *(char *)(a + 16 + l) = 0;
+    *(int *)a = *(int *)p;
+    *(int *)(a + 4) = 0;
+    *(int *)(a + 12) = l;
+    *(int *)p = a;
+    str_end = a + 16 + l + 4 & -4;
+    str_cnt++;
+    return a;
+}
+
+/*
+ * str_tok - 把当前字符串token加入字符串池
+ * 功能：处理转义字符后调用str_find()
+ * 输入：无（使用tokc指向的源码）
+ * 输出：字符串记录
+ * 状态变化：同str_find()
+ * 主要逻辑：直接在str_end + 16处解码，新字符串不需要再复制
+ */
+str_tok()
+{
+    int t, a, c;
+
+    a = str_end + 16;
+    t = tokc;
+    while (*(char *)t != '\"' & *(char *)t != 0) {
+        c = *(char *)t++;
+        if (c == '\\') {
+            c = *(char *)t++;
+            if (c == 'n')
+                c = '\n';
+        }
+        *(char *)a++ = c;
+    }
+    return str_find(str_end + 16, a - str_end - 16);
+}
+
+/*
+ * str_cmp - qsort()的比较函数
+ * 功能：从末尾开始比较两个字符串记录，按降序排列
+ * 输入：a, b - 指向记录地址的指针
+ * 输出：<0, 0, >0
+ * 状态变化：无
+ * 主要逻辑：排序后，一个字符串紧跟在以它结尾的较长字符串之后
+ */
+str_cmp(a, b)
+{
+    int i, j;
+
+    a = *(int *)a + 16;
+    b = *(int *)b + 16;
+    i = a + *(int *)(a - 4);
+    j = b + *(int *)(b - 4);
+    while (i > a & j > b) {
+        i--;
+        j--;
+        if (*(char *)i != *(char *)j)
+            return (*(char *)j & 0xff) - (*(char *)i & 0xff);
+    }
+    return (j > b) - (i > a);
+}
+
+/*
+ * str_pool - 输出字符串池
+ * 功能：把所有字符串写到d，并回填使用它们的指令
+ * 输入：d - 字符串池的位置
+ *       v - 程序中字符串池的地址
+ * 输出：字符串池的字节数
+ * 状态变化：记录中保存池中偏移，使用链表中的地址被回填
+ * 主要逻辑：
+ *   1. 用str_cmp()对记录排序
+ *   2. 如果字符串是前一个字符串的结尾，共享它的内容（后缀合并）
+ *   3. 否则把内容（包括0）复制到池中
+ *   4. 遍历使用链表，写入v + 偏移
+ */
+str_pool(d, v)
+{
+    int r, a, p, i, l, n, s;
+
+    r = malloc(str_cnt * 4 + 4);
+    a = str_buf;
+    i = 0;
+    while (a < str_end) {
+        *(int *)(r + i * 4) = a;
+        a = a + 16 + *(int *)(a + 12) + 4 & -4;
+        i++;
+    }
+    qsort(r, str_cnt, 4, str_cmp);
+    s = 0;
+    p = 0;
+    i = 0;
+    while (i < str_cnt) {
+        a = *(int *)(r + i * 4);
+        l = *(int *)(a + 12);
+        if (p && l <= *(int *)(p + 12) &&
+            !memcmp(p + 16 + *(int *)(p + 12) - l, a + 16, l)) {
+            *(int *)(a + 8) = *(int *)(p + 8) + *(int *)(p + 12) - l;
+        } else {
+            *(int *)(a + 8) = s;
+            memcpy(d + s, a + 16, l + 1);
+            s = s + l + 1;
+        }
+        p = a;
+        a = *(int *)(a + 4);
+        while (a) {
+            n = *(int *)a;
+            *(int *)a = v + *(int *)(p + 8);
+            a = n;
+        }
+        i++;
+    }
+    free(r);
+    return s;
+}
+
+/*
+ * unary - 解析一元表达式
+ * 功能：解析一元表达式，包括常量、变量、函数调用、指针操作等
+ * 输入：l - 是否允许赋值操作（1表示允许）
+ * 输出：无（结果在EAX寄存器中）
+ * 状态变化：
+ *   - 代码缓冲区添加相应指令
+ *   - 可能在字符串池中加入字符串
+ *   - 可能调用next()更新token状态
+ * 主要逻辑：
+ *   1. 处理字符串字面量（加入字符串池，地址在最后回填）
+ *   2. 处理数字常量（加载到EAX）
+ *   3. 处理一元运算符（-, +, !, ~）
+ *   4. 处理括号表达式
+ *   5. 处理指针解引用和类型转换
+ *   6. 处理取地址操作（&）
+ *   7. 处理变量访问和赋值
+ *   8. 处理函数调用（参数压栈、调用、清理栈）
+ */
+unary(l)
+{
+    int n, t, a, b, c, d;
+
+    n = 1; /* type of expression 0 = forward, 1 = value, other =
+              lvalue */
+    if (tok == '\"') {
+        a = str_tok();
+        *(int *)(a + 4) = oad(0xb8, *(int *)(a + 4));
         next();
     } else {
         c = tokl;
@@ -509,15 +1828,29 @@ unary(l)
         t = tok;
         next();
         if (t == TOK_NUM) {
-            li(a);
+            su_li(a);
         } else if (c == 2) {
             /* -, +, !, ~ */
+            b = ind;
             unary(0);
-            oad(0xb9, 0); /* movl $0, %ecx */
-            if (t == '!')
-                gcmp(a);
-            else
-                o(a);
+            if (opt & su_at == b & su_end == ind & su_k == 3) {
+                /* constant */
+                ind = b;
+                if (t == '-')
+                    su_li(-(unsigned)su_v);
+                else if (t == '!')
+                    su_li(!su_v);
+                else if (t == '~')
+                    su_li(~su_v);
+                else
+                    su_li(su_v);
+            } else {
+                oad(0xb9, 0); /* movl $0, %ecx */
+                if (t == '!')
+                    gcmp(a);
+                else
+                    o(a);
+            }
         } else if (t == '(') {
             expr();
             skip(')');
@@ -539,16 +1872,16 @@ unary(l)
             unary(0);
             if (tok == '=') {
                 next();
-                o(0x50); /* push %eax */
+                a = su_keep(11, 0);
                 expr();
-                o(0x59); /* pop %ecx */
+                su_take(a, 0);
                 o(0x0188 + (t == TOK_INT)); /* movl %eax/%al, (%ecx) */
             } else if (t) {
                 if (t == TOK_INT)
                     o(0x8b); /* mov (%eax), %eax */
                 else 
                     o(0xbe0f); /* movsbl (%eax), %eax */
-                ind++; /* add zero in code */
+                *(char *)ind++ = 0; /* zero displacement: the code may be rewritten */
             }
         } else if (t == '&') {
             gmov(10, *(int *)tok); /* leal EA, %eax */
@@ -557,7 +1890,7 @@ unary(l)
             n = *(int *)t;
             /* forward reference: try dlsym */
             if (!n)
-                n = dlsym(0, last_id);
+                n = dlsym(0, *(int *)(t + 12));
             if (tok == '=' & l) {
                 /* assignment */
                 next();
@@ -566,6 +1899,12 @@ unary(l)
             } else if (tok != '(') {
                 /* variable */
                 gmov(8, n); /* mov EA, %eax */
+                if (n < LOCAL && n & 3) {
+                    su_at = ind - 2;
+                    su_end = ind;
+                    su_k = 4;
+                    su_v = t;
+                }
                 if (tokl == 11) {
                     gmov(0, n);
                     o(tokc);
@@ -581,206 +1920,1420 @@ unary(l)
             o(0x50); /* push %eax */
 
         /* push args and invert order */
-        a = oad(0xec81, 0); /* sub $xxx, %esp */
+        a = c = d = 0;
+        if (opt && ra_rd) {
+            /* the arguments go to the outgoing area of the frame, unless
+               something is pushed or a call after the first argument
+               would overwrite them. Else the stack is kept aligned at
+               the call. A function which is inlined makes no call, so
+               the area above what is pushed can take its arguments ('l'
+               is odd if a call follows the first one). */
+            l = su_args(ra_rd);
+            b = 0;
+            if (n != 1)
+                b = ra_find_inl(t);
+            if (b && *(int *)(b + 16) == l)
+                d = su_sp;
+            else if (n == 1 | su_sp | l & 1) {
+                l = l & -4;
+                c = l + (-(su_sp + (n == 1) * 4 + l) & 15);
+                su_sp = su_sp + c + (n == 1) * 4;
+                gesp(0xec, c); /* sub $xxx, %esp */
+            }
+        } else
+            a = oad(0xec81, 0); /* sub $xxx, %esp */
         next();
         l = 0;
         while(tok != ')') {
             expr();
-            oad(0x248489, l); /* movl %eax, xxx(%esp) */
+            if (opt & !(l + d))
+                o(0x240489); /* movl %eax, (%esp) */
+            else if (opt & l + d < 128) {
+                o(0x244489); /* movl %eax, xx(%esp) */
+                *(char *)ind++ = l + d;
+            } else
+                oad(0x248489, l + d); /* movl %eax, xxx(%esp) */
             if (tok == ',')
                 next();
             l = l + 4;
         }
-        *(int *)a = l;
-        next();
-        if (!n) {
-            /* forward reference */
-            t = t + 4;
-            *(int *)t = psym(0xe8, *(int *)t);
-        } else if (n == 1) {
-            oad(0x2494ff, l); /* call *xxx(%esp) */
-            l = l + 4;
-        } else {
-            oad(0xe8, n - ind - 5); /* call xxx */
+        if (a) {
+            *(int *)a = l;
+            c = l;
+        }
+        if (n == 1) {
+            next();
+            oad(0x2494ff, c); /* call *xxx(%esp) */
+            c = c + 4;
+        } else if (!ra_inline(t, l, d)) {
+            next();
+            if (!n) {
+                /* forward reference */
+                t = t + 4;
+                *(int *)t = psym(0xe8, *(int *)t);
+            } else
+                oad(0xe8, n - ind - 5); /* call xxx */
+        }
+        if (c)
+            gesp(0xc4, c); /* add $xxx, %esp */
+        if (!a)
+            su_sp = su_sp - c;
+    }
+}
+
+/*
+ * 表达式临时值（-O）
+ * 二元运算符的左操作数不再用push %eax / pop %ecx保存，而是根据右操作数
+ * 的token选择寄存器。按Sethi-Ullman的编号：右操作数是单个常数或变量
+ * （编号1）时只需要%ecx；否则，左操作数是常数或寄存器变量时先计算
+ * 右操作数再读入左操作数；其他左操作数在右操作数不使用%edx（没有
+ * 函数调用和除法）时放在%edx中；%edx已被占用时才使用栈。
+ * 常数只由su_li()读入，因此两个操作数都是常数时由su_fold()在编译时
+ * 计算，代码换成读入结果。
+ *
+ * su_at..su_end: unary()最后读入的常数或寄存器变量的代码
+ * su_k/su_v: 把它读入%ecx的方式（3: 常数su_v，4: 寄存器变量su_v）
+ * su_edx: %edx中有临时值
+ */
+
+/*
+ * su_args - 函数调用的参数的字节数（-O）
+ * 功能：从调用的第一个参数开始数出参数的个数，并检查第一个参数之后
+ *       有没有函数调用（它会覆盖已经存入输出参数区的参数）
+ * 输入：t - 第一个参数的token（没有参数时是')'）
+ * 输出：参数的字节数，第一个参数之后有调用时再加1
+ */
+su_args(t)
+{
+    int n, d, c;
+
+    n = d = c = 0;
+    if (*(int *)t != ')')
+        n = 4;
+    while (t < ra_tend) {
+        if (*(int *)t == '(') {
+            if (n > 4 && ra_call(t))
+                c = 1;
+            d++;
+        } else if (*(int *)t == ')') {
+            if (!d)
+                break;
+            d--;
+        } else if (*(int *)t == ',' & !d)
+            n = n + 4;
+        t = t + 12;
+    }
+    return n + c;
+}
+
+/*
+ * su_scan - 分析二元运算符的右操作数
+ * 功能：扫描从当前token开始、由优先级低于l的运算符组成的操作数
+ * 输入：l - 运算符的优先级，v - 左操作数的变量
+ * 输出：单个常数或变量（x, &x, x++）时为0，否则为1；使用%edx（函数
+ *       调用或除法）时加2；修改变量v时加4
+ * 状态变化：su_stop指向操作数后面的token
+ */
+su_scan(l, v)
+{
+    int t, p, c, d, e, r, n, u;
+
+    t = ra_rd - 12;
+    d = 0;
+    e = 1; /* an operand is expected */
+    r = 0;
+    n = 0;
+    u = 0; /* the last token is a unary '*' */
+    while (t < ra_tend) {
+        p = *(int *)t;
+        c = *(int *)(t + 8);
+        if (e) {
+            if (p == '(' & u) {
+                /* cast */
+                t = ra_paren(t);
+                n++;
+                u = 0;
+                continue;
+            }
+            u = p == '*';
+            if (p == '(')
+                d++;
+            else if (!(p == '*' | p == '&' | c == 2))
+                e = 0;
+        } else if (p == '(') {
+            /* call */
+            r = r | 2;
+            t = ra_paren(t);
+            n++;
+            continue;
+        } else if (p == TOK_DUMMY & c == 11) {
+            if (*(int *)(t - 12) == v)
+                r = r | 4;
+        } else if (p == '=') {
+            if (*(int *)(t - 12) == v)
+                r = r | 4;
+            if (!d)
+                l = 11; /* the assignment takes all the operators */
+            e = 1;
+        } else if (p == ')') {
+            if (!d)
+                break;
+            d--;
+        } else if (c >= 1 & c <= 10) {
+            if (!d & c >= l)
+                break;
+            if (p == '/' | p == '%')
+                r = r | 2;
+            e = 1;
+        } else if (!d)
+            break;
+        n++;
+        t = t + 12;
+    }
+    su_stop = t;
+    t = ra_rd - 12;
+    if (n == 1 | n == 2 & (*(int *)t == '&' |
+                           *(int *)(t + 12) == TOK_DUMMY &
+                           *(int *)(t + 20) == 11))
+        return r;
+    return r | 1;
+}
+
+/*
+ * su_keep - 计算右操作数时保存左操作数%eax
+ * 输入：l - 右操作数的优先级
+ *       b - 左操作数代码的开始（0表示不能重新读入）
+ * 输出：保存方式，传给su_take()
+ * 状态变化：代码缓冲区添加保存指令，或者删除左操作数的代码
+ * 主要逻辑：
+ *   1. 不用-O时push %eax
+ *   2. 左操作数是常数或寄存器变量且右操作数不修改它：删除它的代码，
+ *      在右操作数之后读入%ecx
+ *   3. 右操作数是单个常数或变量：mov %eax, %ecx
+ *   4. 右操作数不使用%edx且%edx空闲：mov %eax, %edx
+ *   5. 否则push %eax
+ */
+su_keep(l, b)
+{
+    int r;
+
+    if (!opt | !ra_rd) {
+        o(0x50); /* push %eax */
+        su_sp = su_sp + 4;
+        return 0;
+    }
+    r = su_scan(l, su_v);
+    if (b && su_at == b & su_end == ind & !(r & 4)) {
+        ind = b;
+        return su_k;
+    }
+    if (!r) {
+        o(0xc189); /* mov %eax, %ecx */
+        return 1;
+    }
+    if (!(r & 2) & !su_edx) {
+        su_edx = 1;
+        o(0xc289); /* mov %eax, %edx */
+        return 2;
+    }
+    o(0x50); /* push %eax */
+    su_sp = su_sp + 4;
+    return 0;
+}
+
+/*
+ * su_li - 读入常数v，并记录这段代码
+ */
+su_li(v)
+{
+    su_at = ind;
+    li(v);
+    su_end = ind;
+    su_k = 3;
+    su_v = v;
+}
+
+/*
+ * su_fold - 常数折叠
+ * 功能：在编译时计算常数a和su_v（最后的代码读入它）的二元运算
+ * 输入：n - 运算符的token，t - 它的代码（tokc），a - 左操作数
+ * 输出：运行时idiv会出错（除以0或溢出）时返回0，否则返回1
+ * 状态变化：删除su_v的代码，读入结果
+ */
+su_fold(n, t, a)
+{
+    int b;
+
+    b = su_v;
+    if (n == '/' | n == '%') {
+        if (!b | a == 0x80000000 & b == -1)
+            return 0;
+        if (n == '/')
+            a = a / b;
+        else
+            a = a % b;
+    } else if (n == '*') /* unsigned: no overflow, as on the target */
+        a = (unsigned)a * b;
+    else if (n == '+')
+        a = (unsigned)a + b;
+    else if (n == '-')
+        a = (unsigned)a - b;
+    else if (n == '&')
+        a = a & b;
+    else if (n == '^')
+        a = a ^ b;
+    else if (n == '|')
+        a = a | b;
+    else if (t == 0xe0d391) /* << */
+        a = (unsigned)a << (b & 31);
+    else if (t == 0xf8d391) /* >> */
+        a = a >> (b & 31);
+    else if (t == 4)
+        a = a == b;
+    else if (t == 5)
+        a = a != b;
+    else if (t == 0xc)
+        a = a < b;
+    else if (t == 0xd)
+        a = a >= b;
+    else if (t == 0xe)
+        a = a <= b;
+    else
+        a = a > b;
+    ind = su_at;
+    su_li(a);
+    return 1;
+}
+
+/*
+ * su_imm - 右操作数为常数的二元运算
+ * 功能：左操作数留在%eax，常数su_v（最后的代码读入它）作为立即数，
+ *       能用imm8时用imm8
+ * 输入：k, v - 同su_take()，n - 运算符的token，t - 它的代码（tokc），
+ *       l - 它的优先级
+ * 输出：无
+ * 状态变化：删除su_keep()的代码和常数的代码，生成带立即数的指令，
+ *           可能释放%edx
+ * 主要逻辑：
+ *   1. +、|、&、-、^的代码就是"op %ecx, %eax"，(t & 0xff) >> 3就是
+ *      0x83/0x81指令组的操作号，比较用其中的cmp（7）
+ *   2. *交给su_mul()，<<和>>用shl/sar $xx, %eax
+ *   3. /和%交给su_div()
+ */
+su_imm(k, v, n, t, l)
+{
+    int a, b;
+
+    b = su_v;
+    ind = su_at;
+    su_at = 0;
+    if (k == 0) {
+        su_sp = su_sp - 4;
+        ind--; /* push %eax */
+    }
+    else if (k == 4)
+        o(0xc08b + *(int *)v * 0x100); /* mov %reg, %eax */
+    else {
+        ind = ind - 2; /* mov %eax, %ecx/%edx */
+        if (k == 2)
+            su_edx = 0;
+    }
+    if (n == '/' | n == '%')
+        su_div(n == '%', b);
+    else if (l == 3) {
+        if (b & 31) {
+            /* shl/sar $xx, %eax */
+            o(0xe0c1 + (t == 0xf8d391) * 0x1800);
+            *(char *)ind++ = b & 31;
+        }
+    } else if (n == '*')
+        su_mul(b);
+    else {
+        if (l == 4 | l == 5)
+            a = 7; /* cmp */
+        else
+            a = (t & 0xff) >> 3; /* add, or, and, sub, xor */
+        if (b >= -128 & b < 128) {
+            o(0xc083 + a * 0x800); /* op $xx, %eax */
+            *(char *)ind++ = b;
+        } else
+            oad(a * 8 + 5, b);
+        if (l == 4 | l == 5)
+            gset(t);
+    }
+}
+
+/*
+ * su_mul - %eax乘以常数
+ * 功能：0、1、-1、2的幂和3、5、9不用imul
+ * 输入：b - 常数
+ * 输出：无
+ * 状态变化：代码缓冲区添加指令
+ * 主要逻辑：
+ *   1. 0用xor，-1用neg，2用add，其他2的幂用shl
+ *   2. 3、5、9用lea (%eax, %eax, 2/4/8), %eax
+ *   3. 其余用imul $xx, %eax, %eax
+ */
+su_mul(b)
+{
+    int k;
+
+    k = 0;
+    while (k < 30 & 1 << k < b)
+        k++;
+    if (!b)
+        o(0xc031); /* xor %eax, %eax */
+    else if (b == -1)
+        o(0xd8f7); /* neg %eax */
+    else if (1 << k == b) {
+        if (k == 1)
+            o(0xc001); /* add %eax, %eax */
+        else if (k)
+            o(0xe0c1 + k * 0x10000); /* shl $k, %eax */
+    } else if (b == 3 | b == 5 | b == 9)
+        o(0x048d + (k - 1) * 0x400000); /* lea (%eax, %eax, b - 1), %eax */
+    else if (b >= -128 & b < 128) {
+        o(0xc06b); /* imul $xx, %eax, %eax */
+        *(char *)ind++ = b;
+    } else
+        oad(0xc069, b);
+}
+
+/*
+ * su_div - %eax除以常数
+ * 功能：不用idiv计算%eax / b或%eax % b，舍入和idiv一样（向零舍入）
+ * 输入：m - 非0表示取余，b - 常数
+ * 输出：无
+ * 状态变化：代码缓冲区添加指令，使用%ecx和%edx（su_scan()已经为/和%
+ *           留出了%edx）
+ * 主要逻辑：
+ *   1. |b|为1时结果是x、-x或0；b为0、0x80000000或|b| >= 2^30时仍用idiv
+ *   2. |b| = 2^k：负数先加上2^k - 1（sar/shr得到），再sar $k；取余则
+ *      and $2^k - 1后再减去加上的数
+ *   3. 其他：k = ceil(log2 |b|)，m = 2^(31+k) / |b| + 1（用长除法求出
+ *      低32位），商 = ((x + (m * x >> 32)) >> (k - 1)) - (x >> 31)
+ *      （Granlund-Montgomery）；取余则 x - 商 * |b|
+ *   4. b < 0时商取负，余数与除数的符号无关
+ */
+su_div(m, b)
+{
+    int a, i, k, q, r;
+
+    a = b;
+    if (a < 0 & a != 0x80000000)
+        a = -a;
+    if (a == 1) {
+        if (m)
+            o(0xc031); /* xor %eax, %eax */
+        else if (b < 0)
+            o(0xd8f7); /* neg %eax */
+        return;
+    }
+    if (a < 2 | a >= 0x40000000) {
+        /* 0, 0x80000000 and the largest divisors: keep idiv */
+        oad(0xb9, b); /* mov $xx, %ecx */
+        o(0xf9f799); /* cltd, idiv %ecx */
+        if (m)
+            o(0x92); /* xchg %edx, %eax */
+        return;
+    }
+    k = 0;
+    while (1 << k < a)
+        k++;
+    o(0xc189); /* mov %eax, %ecx */
+    if (1 << k == a) {
+        /* a negative dividend is rounded toward zero by adding a - 1 */
+        if (k > 1)
+            o(0x1ff9c1); /* sar $31, %ecx */
+        o(0xe9c1 + (32 - k) * 0x10000); /* shr $32 - k, %ecx */
+        o(0xc801); /* add %ecx, %eax */
+        if (m) {
+            if (a <= 128) {
+                o(0xe083); /* and $a - 1, %eax */
+                *(char *)ind++ = a - 1;
+            } else
+                oad(0x25, a - 1);
+            o(0xc829); /* sub %ecx, %eax */
+        } else
+            o(0xf8c1 + k * 0x10000); /* sar $k, %eax */
+    } else {
+        /* 2^(31 + k) / a, modulo 2^32, by long division */
+        q = 0;
+        r = 1;
+        i = k + 31;
+        while (i--) {
+            q = (unsigned)q * 2;
+            r = r * 2;
+            if (r >= a) {
+                q++;
+                r = r - a;
+            }
+        }
+        oad(0xb8, q + 1); /* mov $xx, %eax */
+        o(0xe9f7); /* imul %ecx */
+        o(0xca01); /* add %ecx, %edx */
+        if (k > 1)
+            o(0xfac1 + (k - 1) * 0x10000); /* sar $k - 1, %edx */
+        o(0xc889); /* mov %ecx, %eax */
+        o(0x1ff8c1); /* sar $31, %eax */
+        o(0xc229); /* sub %eax, %edx */
+        if (m) {
+            if (a < 128) {
+                o(0xc26b); /* imul $a, %edx, %eax */
+                *(char *)ind++ = a;
+            } else
+                oad(0xc269, a);
+            o(0xc129); /* sub %eax, %ecx */
+            o(0xc889); /* mov %ecx, %eax */
+            return;
+        }
+        o(0xd089); /* mov %edx, %eax */
+    }
+    if (!m & b < 0)
+        o(0xd8f7); /* neg %eax */
+}
+
+/*
+ * su_take - 把su_keep()保存的左操作数放进%ecx
+ * 输入：k - su_keep()的返回值，v - su_keep()之后的su_v
+ * 输出：无
+ * 状态变化：代码缓冲区添加指令，可能释放%edx
+ */
+su_take(k, v)
+{
+    su_at = 0;
+    if (k == 0) {
+        su_sp = su_sp - 4;
+        o(0x59); /* pop %ecx */
+    }
+    else if (k == 2) {
+        su_edx = 0;
+        o(0xd189); /* mov %edx, %ecx */
+    } else if (k == 3)
+        oad(0xb9, v); /* mov $xx, %ecx */
+    else if (k == 4)
+        o(0xc189 + *(int *)v * 0x800); /* mov %reg, %ecx */
+}
+
+/*
+ * sum - 解析二元表达式（运算符优先级）
+ * 功能：使用递归下降法解析二元表达式，处理运算符优先级
+ * 输入：l - 当前运算符优先级层次
+ * 输出：无（结果在EAX寄存器中）
+ * 状态变化：
+ *   - 代码缓冲区添加运算指令
+ *   - 可能调用next()更新token状态
+ * 主要逻辑：
+ *   1. 如果优先级为1，调用unary()处理一元表达式
+ *   2. 否则递归处理更高优先级的表达式
+ *   3. 处理当前优先级的运算符
+ *   4. 对于逻辑运算符（&&, ||），生成短路求值代码
+ *   5. 对于算术和比较运算符，生成相应的机器指令，左操作数由
+ *      su_keep()/su_take()保存
+ */
+sum(l)
+{
+    int t, n, a, b, c, e, v;
+
+    if (l-- == 1)
+        unary(1);
+    else {
+        b = ind;
+        sum(l);
+        a = 0;
+        while (l == tokl) {
+            n = tok;
+            t = tokc;
+            next();
+
+            if (l > 8) {
+                a = gtst(t, a); /* && and || output code generation */
+                sum(l);
+            } else {
+                c = su_keep(l, b);
+                v = su_v;
+                e = ind;
+                sum(l);
+                if (opt & su_at == e & su_end == ind & su_k == 3) {
+                    /* constant right operand */
+                    if (c != 3) {
+                        su_imm(c, v, n, t, l);
+                        continue;
+                    }
+                    if (su_fold(n, t, v))
+                        continue;
+                }
+                su_take(c, v);
+                
+                if (l == 4 | l == 5) {
+                    gcmp(t);
+                } else {
+                    o(t);
+                    if (n == '%')
+                        o(0x92); /* xchg %edx, %eax */
+                }
+            }
+        }
+        /* && and || output code generation */
+        if (a && l > 8) {
+            a = gtst(t, a);
+            li(t ^ 1);
+            c = gjmp(0); /* jmp over li(t) */
+            gsym(a);
+            li(t);
+            gsym(c);
+        }
+    }
+}
+
+/*
+ * su_cond - -O时把条件编译成跳转
+ * 功能：编译优先级为l（同sum()）的条件，在条件为j时跳到链表a，否则
+ *       顺序执行，&&和||不再生成0/1的值
+ * 输入：l - 优先级，j - 0：条件为假时跳转，1：条件为真时跳转，
+ *       a - 跳转链表
+ * 输出：新的跳转链表
+ * 状态变化：代码缓冲区添加条件的代码和跳转指令
+ * 主要逻辑：
+ *   1. 不含&&和||的操作数：常数时没有代码或是无条件跳转，最后的代码
+ *      是比较时删除setxx的代码直接生成jcc，否则是test %eax, %eax
+ *   2. &&（t = 0）和||（t = 1）：用su_scan()看操作数后面是否还有同样
+ *      的运算符。操作数为t时整个条件就是t：j == t时所有操作数都在为t
+ *      时跳到a；否则前面的操作数为t时跳到条件的结尾，最后一个操作数
+ *      为j时跳到a
+ */
+su_cond(l, j, a)
+{
+    int b, c, t;
+
+    l--;
+    if (l < 9) {
+        b = ind;
+        su_set = 0;
+        sum(l + 1);
+        if (su_at == b & su_end == ind & su_k == 3) {
+            /* constant: no test */
+            ind = b;
+            if (!su_v == !j)
+                return gjmp(a);
+            return a;
+        }
+        if (su_set == ind) {
+            /* comparison: jump on its condition */
+            ind = ind - 8;
+            o(0x0f);
+            return psym(0x80 + (su_cc ^ !j), a);
+        }
+        return gtst(j, a);
+    }
+    t = l - 9;
+    c = 0;
+    while (1) {
+        su_scan(l, 0);
+        if (*(int *)(su_stop + 8) != l)
+            break;
+        if (t == j)
+            a = su_cond(l, t, a);
+        else
+            c = su_cond(l, t, c);
+        next();
+    }
+    a = su_cond(l, j, a);
+    gsym(c);
+    return a;
+}
+
+/*
+ * expr - 解析完整表达式
+ * 功能：解析完整的表达式，从最低优先级开始
+ * 输入：无
+ * 输出：无（结果在EAX寄存器中）
+ * 状态变化：通过sum()函数改变代码生成状态
+ * 主要逻辑：调用sum(11)从最低优先级开始解析表达式
+ */
+expr()
+{
+    sum(11);
+}
+
+
+/*
+ * test_expr - 解析测试表达式
+ * 功能：解析表达式并生成条件跳转，用于if/while等语句
+ * 输入：无
+ * 输出：返回条件跳转指令的地址（用于后续回填）
+ * 状态变化：
+ *   - 通过expr()生成表达式计算代码
+ *   - 通过gtst()生成条件跳转指令
+ * 主要逻辑：
+ *   1. 调用expr()计算表达式值
+ *   2. 调用gtst(0,0)生成je指令（表达式为假时跳转）
+ *   3. -O时用su_cond()把条件直接编译成跳转
+ */
+test_expr()
+{
+    if (opt && ra_rd)
+        return su_cond(11, 0, 0);
+    expr();
+    return gtst(0, 0);
+}
+
+/*
+ * block - 解析语句块
+ * 功能：解析各种类型的语句（if、while、for、复合语句、表达式语句等）
+ * 输入：l - 用于break语句的跳转链表指针
+ * 输出：无
+ * 状态变化：
+ *   - 代码缓冲区添加语句对应的指令
+ *   - 可能修改rsym（return语句跳转链）
+ *   - 可能调用next()更新token状态
+ * 主要逻辑：
+ *   1. if语句：处理条件跳转和else分支
+ *   2. while/for循环：处理循环条件和跳转
+ *   3. 复合语句（{}）：处理局部声明和嵌套语句
+ *   4. return语句：生成返回跳转
+ *   5. break语句：添加到break跳转链
+ *   6. 表达式语句：计算表达式值
+ */
+block(l)
+{
+    int a, n, t;
+
+    if (tok == TOK_IF) {
+        next();
+        skip('(');
+        a = test_expr();
+        skip(')');
+        block(l);
+        if (tok == TOK_ELSE) {
+            next();
+            n = gjmp(0); /* jmp */
+            gsym(a);
+            block(l);
+            gsym(n); /* patch else jmp */
+        } else {
+            gsym(a); /* patch if test */
+        }
+    } else if (tok == TOK_WHILE | tok == TOK_FOR) {
+        t = tok;
+        next();
+        skip('(');
+        if (t == TOK_WHILE) {
+            n = ind;
+            a = test_expr();
+        } else {
+            if (tok != ';')
+                expr();
+            skip(';');
+            n = ind;
+            a = 0;
+            if (tok != ';')
+                a = test_expr();
+            skip(';');
+            if (tok != ')') {
+                t = gjmp(0);
+                expr();
+                gjmp(n - ind - 5);
+                gsym(t);
+                n = t + 4;
+            }
+        }
+        skip(')');
+        block(&a);
+        gjmp(n - ind - 5); /* jmp */
+        gsym(a);
+    } else if (tok == '{') {
+        next();
+        /* declarations */
+        decl(1);
+        while(tok != '}')
+            block(l);
+        next();
+    } else {
+        if (tok == TOK_RETURN) {
+            next();
+            if (!ra_tail()) {
+                if (tok != ';')
+                    expr();
+                rsym = gjmp(rsym); /* jmp */
+            }
+        } else if (tok == TOK_BREAK) {
+            next();
+            *(int *)l = gjmp(*(int *)l);
+        } else if (tok != ';')
+            expr();
+        skip(';');
+    }
+}
+
+/*
+ * 寄存器分配（-O）
+ * 编译一个函数之前先读入它的全部token（ra_tok..ra_tend），再由next()
+ * 重新提供给语法分析器。每个参数和局部变量的活跃区间从声明开始到最后
+ * 一次使用为止，并扩展到它经过的整个循环。对区间做线性扫描，把变量
+ * 放进ebx, esi, edi（由函数保存），其余变量留在栈上。取过地址的变量
+ * 总是在栈上。
+ *
+ * ra_tab..ra_end: (符号, 开始, 结束, 寄存器, 使用次数, 栈偏移)，
+ *       开始和结束是ra_tok中的token；寄存器为-1表示不能放进寄存器
+ * ra_lp..ra_lend: 循环的(开始, 结束)
+ */
+
+/*
+ * ra_put - 把当前token追加到函数的token缓冲区
+ * 功能：记录tok, tokc, tokl
+ * 输入：无
+ * 输出：无
+ * 状态变化：ra_tend向前移动，缓冲区满时扩大一倍
+ */
+ra_put()
+{
+    int a;
+
+    if (ra_tend + 12 > ra_tlim) {
+        a = (ra_tlim - ra_tok) * 2;
+        ra_tend = ra_tend - ra_tok;
+        ra_tok = realloc(ra_tok, a);
+        ra_tend = ra_tend + ra_tok;
+        ra_tlim = ra_tok + a;
+    }
+    *(int *)ra_tend = tok;
+    *(int *)(ra_tend + 4) = tokc;
+    *(int *)(ra_tend + 8) = tokl;
+    ra_tend = ra_tend + 12;
+}
+
+/*
+ * ra_read - 读入从当前token开始的函数
+ * 功能：读到函数结尾的'}'以及它后面的一个token，然后让next()重新
+ *       提供这些token
+ * 输入：无
+ * 输出：无
+ * 状态变化：ra_tok..ra_tend为函数的token，ra_rd指向第二个token
+ */
+ra_read()
+{
+    int d;
+
+    ra_tend = ra_tok;
+    d = 0;
+    while (1) {
+        ra_put();
+        if (tok == '{')
+            d++;
+        if (tok == '}') {
+            d--;
+            if (!d)
+                break;
+        }
+        if (tok == -1)
+            break;
+        next();
+    }
+    next();
+    ra_put();
+    tok = *(int *)ra_tok;
+    tokc = *(int *)(ra_tok + 4);
+    tokl = *(int *)(ra_tok + 8);
+    ra_rd = ra_tok + 12;
+}
+
+/*
+ * ra_var - 加入一个变量
+ * 功能：第一次声明时为符号v建立一项，开始和结束都是声明的token s
+ * 输入：v - 符号，s - 声明所在的token
+ * 输出：无
+ * 状态变化：ra_end可能向前移动
+ */
+ra_var(v, s)
+{
+    int a;
+
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)a == v)
+            return;
+        a = a + 24;
+    }
+    *(int *)a = v;
+    *(int *)(a + 4) = s;
+    *(int *)(a + 8) = s;
+    *(int *)(a + 12) = 0;
+    *(int *)(a + 16) = 0;
+    *(int *)(a + 20) = 0;
+    ra_end = a + 24;
+}
+
+/*
+ * ra_find - 查找变量
+ * 输入：v - 符号
+ * 输出：变量的项，不是当前函数的变量时返回0
+ * 状态变化：无
+ */
+ra_find(v)
+{
+    int a;
+
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)a == v)
+            return a;
+        a = a + 24;
+    }
+    return 0;
+}
+
+/*
+ * ra_paren - 跳过括号
+ * 输入：t - '('所在的token
+ * 输出：匹配的')'后面的token
+ * 状态变化：无
+ */
+ra_paren(t)
+{
+    int d;
+
+    d = 0;
+    while (t < ra_tend) {
+        if (*(int *)t == '(')
+            d++;
+        t = t + 12;
+        if (*(int *)(t - 12) == ')' && !--d)
+            break;
+    }
+    return t;
+}
+
+/*
+ * ra_call - 括号是不是函数调用
+ * 输入：t - '('所在的token
+ * 输出：它跟在名字后面，或跟在不是类型转换结尾的')'后面时为1
+ */
+ra_call(t)
+{
+    int v;
+
+    v = *(int *)(t - 12);
+    return v > TOK_DEFINE | v == ')' & *(int *)(t - 24) != '*';
+}
+
+/*
+ * ra_stmt - 跳过一个语句
+ * 功能：按block()的方式分析token t开始的语句
+ * 输入：t - 语句的第一个token
+ * 输出：语句后面的token
+ * 状态变化：记录局部变量声明（ra_var）和循环（ra_lp..ra_lend）
+ */
+ra_stmt(t)
+{
+    int v, a;
+
+    v = *(int *)t;
+    if (v == TOK_IF) {
+        t = ra_stmt(ra_paren(t + 12));
+        if (t < ra_tend && *(int *)t == TOK_ELSE)
+            t = ra_stmt(t + 12);
+    } else if (v == TOK_WHILE | v == TOK_FOR) {
+        a = t;
+        t = ra_stmt(ra_paren(t + 12));
+        *(int *)ra_lend = a;
+        *(int *)(ra_lend + 4) = t;
+        ra_lend = ra_lend + 8;
+    } else if (v == '{') {
+        t = t + 12;
+        while (t < ra_tend && *(int *)t == TOK_INT) {
+            t = t + 12;
+            while (t < ra_tend && *(int *)t != ';') {
+                if (*(int *)t > TOK_DEFINE)
+                    ra_var(*(int *)t, t);
+                if (*(int *)t != ',')
+                    ra_loc = ra_loc + 4;
+                t = t + 12;
+            }
+            t = t + 12;
+        }
+        while (t < ra_tend && *(int *)t != '}')
+            t = ra_stmt(t);
+        t = t + 12;
+    } else {
+        while (t < ra_tend && *(int *)t != ';')
+            t = t + 12;
+        t = t + 12;
+    }
+    return t;
+}
+
+/*
+ * ra_cmp - qsort()的比较函数，按区间开始排序
+ */
+ra_cmp(a, b)
+{
+    return *(int *)(a + 4) - *(int *)(b + 4);
+}
+
+/*
+ * ra_scan - 为当前函数分配寄存器
+ * 功能：根据ra_tok中的token计算变量的活跃区间并做线性扫描
+ * 输入：无
+ * 输出：无
+ * 状态变化：ra_tab中的项得到寄存器，ra_used为使用的寄存器集合，
+ *           ra_arg为参数的字节数，ra_addr表示取了参数或局部变量的地址，
+ *           ra_esp为函数体中%ebp和%esp的距离
+ * 主要逻辑：
+ *   1. 参数从函数入口开始活跃，局部变量从声明开始
+ *   2. 统计使用次数和结束位置；'&'前面不是操作数（类型转换不算）时是取地址
+ *   3. 区间和循环相交时扩展到整个循环
+ *   4. 只使用一次的变量不值得占用寄存器
+ *   5. 按开始排序后线性扫描：有空闲寄存器就使用，否则从结束最晚的
+ *      活跃变量那里取得寄存器（如果它结束得更晚）
+ *   6. 输出参数区ra_out是最大的调用的参数字节数；有调用时补齐到调用
+ *      处栈按16字节对齐（返回地址、%ebp、局部变量和保存的寄存器在
+ *      它上面）
+ */
+ra_scan()
+{
+    int t, a, v, n, r;
+
+    n = (ra_tend - ra_tok) / 12;
+    ra_tab = realloc(ra_tab, n * 32);
+    ra_end = ra_tab;
+    ra_lp = ra_lend = ra_tab + n * 24;
+    ra_used = ra_addr = 0;
+    ra_loc = 0;
+    ra_arg = su_args(ra_tok + 24);
+    t = ra_tok + 24;
+    while (t < ra_tend && *(int *)t != ')') {
+        if (*(int *)t != ',')
+            ra_var(*(int *)t, ra_tok);
+        t = t + 12;
+    }
+    ra_stmt(t + 12);
+
+    t = ra_tok + 24;
+    while (t < ra_tend - 12) {
+        a = ra_find(*(int *)t);
+        if (a && t > *(int *)(a + 4)) {
+            *(int *)(a + 8) = t;
+            *(int *)(a + 16) = *(int *)(a + 16) + 1;
+            v = *(int *)(t - 24);
+            if (*(int *)(t - 12) == '&' &
+                !(v > TOK_DEFINE | v == TOK_NUM | v == '\"' |
+                  v == ')' & *(int *)(t - 36) != '*')) {
+                *(int *)(a + 12) = -1;
+                ra_addr = 1;
+            }
+        }
+        t = t + 12;
+    }
+
+    a = ra_tab;
+    while (a < ra_end) {
+        t = ra_lp;
+        while (t < ra_lend) {
+            if (*(int *)(a + 4) < *(int *)(t + 4) &
+                *(int *)(a + 8) >= *(int *)t) {
+                if (*(int *)t < *(int *)(a + 4))
+                    *(int *)(a + 4) = *(int *)t;
+                if (*(int *)(t + 4) > *(int *)(a + 8))
+                    *(int *)(a + 8) = *(int *)(t + 4);
+            }
+            t = t + 8;
+        }
+        if (*(int *)(a + 16) < 2)
+            *(int *)(a + 12) = -1;
+        a = a + 24;
+    }
+    qsort(ra_tab, (ra_end - ra_tab) / 24, 24, ra_cmp);
+
+    a = ra_tab;
+    while (a < ra_end) {
+        if (!*(int *)(a + 12)) {
+            v = 0;
+            n = 0x070603; /* ebx, esi, edi */
+            while (n) {
+                r = n & 255;
+                n = n >> 8;
+                t = ra_tab;
+                while (t < a && (*(int *)(t + 12) != r |
+                                 *(int *)(t + 8) < *(int *)(a + 4)))
+                    t = t + 24;
+                if (t == a) {
+                    *(int *)(a + 12) = r;
+                    break;
+                }
+                if (!v || *(int *)(t + 8) > *(int *)(v + 8))
+                    v = t;
+            }
+            if (!*(int *)(a + 12) && *(int *)(v + 8) > *(int *)(a + 8)) {
+                *(int *)(a + 12) = *(int *)(v + 12);
+                *(int *)(v + 12) = 0;
+            }
+            if (*(int *)(a + 12) > 0)
+                ra_used = ra_used | 1 << *(int *)(a + 12);
+        }
+        a = a + 24;
+    }
+
+    /* outgoing argument area */
+    ra_out = n = 0;
+    t = ra_tok + 24;
+    while (t < ra_tend) {
+        if (*(int *)t == '(' && ra_call(t)) {
+            a = su_args(t + 12) & -4;
+            if (a > ra_out)
+                ra_out = a;
+            n = 1;
+        }
+        t = t + 12;
+    }
+    ra_esp = ra_loc;
+    r = 3;
+    while (r < 8) {
+        if (ra_used >> r & 1)
+            ra_esp = ra_esp + 4;
+        r++;
+    }
+    if (n)
+        ra_out = ra_out + (-(ra_esp + ra_out + 8) & 15);
+    ra_esp = ra_esp + ra_out;
+}
+
+/*
+ * 内联（-O）
+ * 函数体是"{ return e; }"、e较短、没有调用、没有字符串也不取地址时，
+ * 保留它的token。之后直接调用它时参数和调用一样存入栈中，然后编译e，
+ * 参数就是这些参数的栈位置。函数只在定义之后才能内联。OTCC没有作用域，
+ * e中的其他名字（全局变量）暂时取回它们在函数定义时的值，调用者的
+ * 同名局部变量不会改变e的意义。
+ *
+ * ra_inl: 散列表，每项为(next, 符号, e的第一个token, 它的';'之后的
+ *         token, 参数的字节数, 其他名字的个数, (参数, 保存的值)...,
+ *         (名字, 函数中的值, 保存的值)...)
+ */
+
+/*
+ * ra_keep - 保留可以内联的函数（-O）
+ * 功能：当前函数可以内联时把它的token复制到ra_inl的一项中
+ * 输入：无（ra_tok..ra_tend为函数的token，ra_scan已经执行）
+ * 输出：无
+ * 状态变化：ra_inl添加一项
+ */
+ra_keep()
+{
+    int t, e, a, p, n, v;
+
+    t = ra_paren(ra_tok + 12);
+    if (ra_addr | *(int *)t != '{' | *(int *)(t + 12) != TOK_RETURN)
+        return;
+    e = t + 24;
+    n = 0;
+    while (e < ra_tend && *(int *)e != ';') {
+        v = *(int *)e;
+        if (e >= t + 24 + INLINE_MAX * 12 | v == '\"' ||
+            v == '(' && ra_call(e))
+            return;
+        /* a name other than a parameter (the body has no locals) */
+        if (v > TOK_DEFINE && !ra_find(v)) {
+            if (!*(int *)v)
+                return; /* not defined yet */
+            n++;
+        }
+        e = e + 12;
+    }
+    if (e == t + 24 | e + 12 >= ra_tend || *(int *)(e + 12) != '}')
+        return;
+    if (!ra_inl)
+        ra_inl = calloc(4, 256);
+    a = malloc(24 + ra_arg * 2 + n * 12 + (e + 12 - t));
+    p = ra_inl + (*(int *)ra_tok >> 4 & 255) * 4;
+    *(int *)a = *(int *)p;
+    *(int *)p = a;
+    *(int *)(a + 4) = *(int *)ra_tok;
+    *(int *)(a + 16) = ra_arg;
+    /* the parameters */
+    p = a + 24;
+    v = ra_tok + 24;
+    while (*(int *)v != ')') {
+        if (*(int *)v != ',') {
+            *(int *)p = *(int *)v;
+            p = p + 8;
+        }
+        v = v + 12;
+    }
+    /* the other names with their values, once each */
+    v = t + 24;
+    while (v < e) {
+        if (*(int *)v > TOK_DEFINE && !ra_find(*(int *)v)) {
+            n = a + 24 + ra_arg * 2;
+            while (n < p && *(int *)n != *(int *)v)
+                n = n + 12;
+            if (n == p) {
+                *(int *)p = *(int *)v;
+                *(int *)(p + 4) = *(int *)*(int *)v;
+                p = p + 12;
+            }
         }
-        if (l)
-            oad(0xc481, l); /* add $xxx, %esp */
+        v = v + 12;
     }
+    *(int *)(a + 20) = (p - a - 24 - ra_arg * 2) / 12;
+    /* the tokens from '{', the first ones being looked behind */
+    memcpy(p, t, e + 12 - t);
+    *(int *)(a + 8) = p + 24;
+    *(int *)(a + 12) = p + (e + 12 - t);
 }
 
 /*
- * sum - 解析二元表达式（运算符优先级）
- * 功能：使用递归下降法解析二元表达式，处理运算符优先级
- * 输入：l - 当前运算符优先级层次
- * 输出：无（结果在EAX寄存器中）
- * 状态变化：
- *   - 代码缓冲区添加运算指令
- *   - 可能调用next()更新token状态
+ * ra_find_inl - 查找可以内联的函数
+ * 输入：t - 函数的符号
+ * 输出：它在ra_inl中的项，没有时为0
+ */
+ra_find_inl(t)
+{
+    int a;
+
+    if (!ra_inl)
+        return 0;
+    a = *(int *)(ra_inl + (t >> 4 & 255) * 4);
+    while (a && *(int *)(a + 4) != t)
+        a = *(int *)a;
+    return a;
+}
+
+/*
+ * ra_inline - 内联函数调用（-O）
+ * 功能：可以内联时编译函数的表达式代替调用
+ * 输入：t - 函数的符号，l - 参数的字节数，d - 参数在%esp之上的偏移
+ * 输出：内联时为1，否则为0（什么也不做）
+ * 状态变化：代码缓冲区添加指令，读完')'
  * 主要逻辑：
- *   1. 如果优先级为1，调用unary()处理一元表达式
- *   2. 否则递归处理更高优先级的表达式
- *   3. 处理当前优先级的运算符
- *   4. 对于逻辑运算符（&&, ||），生成短路求值代码
- *   5. 对于算术和比较运算符，生成相应的机器指令
+ *   1. 参数的符号暂时取参数所在的栈偏移（相对%ebp），其他名字取
+ *      它们在函数中的值
+ *   2. 从保留的token读入并编译表达式，然后恢复ra_rd和这些符号的值
  */
-sum(l)
+ra_inline(t, l, d)
 {
-    int t, n, a;
+    int a, p, e, f, r, v;
 
-    if (l-- == 1)
-        unary(1);
-    else {
-        sum(l);
-        a = 0;
-        while (l == tokl) {
-            n = tok;
-            t = tokc;
-            next();
+    a = ra_find_inl(t);
+    if (!opt | !ra_rd | !a || *(int *)(a + 16) != l)
+        return 0;
+    e = a + 24 + l * 2;
+    f = e + *(int *)(a + 20) * 12;
+    /* the parameters take the slots of the arguments */
+    v = d - ra_esp - su_sp;
+    p = a + 24;
+    while (p < e) {
+        *(int *)(p + 4) = *(int *)*(int *)p;
+        *(int *)*(int *)p = v;
+        v = v + 4;
+        p = p + 8;
+    }
+    /* and the other names their values in the function, which a local
+       of the caller may hide */
+    while (p < f) {
+        *(int *)(p + 8) = *(int *)*(int *)p;
+        *(int *)*(int *)p = *(int *)(p + 4);
+        p = p + 12;
+    }
+    r = ra_rd;
+    v = ra_tend;
+    ra_rd = *(int *)(a + 8);
+    ra_tend = *(int *)(a + 12);
+    next();
+    expr();
+    ra_rd = r;
+    ra_tend = v;
+    next();
+    p = a + 24;
+    while (p < e) {
+        *(int *)*(int *)p = *(int *)(p + 4);
+        p = p + 8;
+    }
+    while (p < f) {
+        *(int *)*(int *)p = *(int *)(p + 8);
+        p = p + 12;
+    }
+    return 1;
+}
 
-            if (l > 8) {
-                a = gtst(t, a); /* && and || output code generation */
-                sum(l);
-            } else {
-                o(0x50); /* push %eax */
-                sum(l);
-                o(0x59); /* pop %ecx */
-                
-                if (l == 4 | l == 5) {
-                    gcmp(t);
-                } else {
-                    o(t);
-                    if (n == '%')
-                        o(0x92); /* xchg %edx, %eax */
-                }
-            }
-        }
-        /* && and || output code generation */
-        if (a && l > 8) {
-            a = gtst(t, a);
-            li(t ^ 1);
-            gjmp(5); /* jmp $ + 5 */
-            gsym(a);
-            li(t);
-        }
+/*
+ * ra_set - 设置参数或局部变量的值
+ * 功能：变量在寄存器中时值为寄存器号（3, 6或7，不是4的倍数），栈偏移
+ *       保存在它的项中
+ * 输入：t - 符号，n - 栈偏移
+ * 输出：无
+ * 状态变化：符号的值
+ */
+ra_set(t, n)
+{
+    int a;
+
+    *(int *)t = n;
+    a = ra_find(t);
+    if (a && *(int *)(a + 12) > 0) {
+        *(int *)(a + 20) = n;
+        *(int *)t = *(int *)(a + 12);
     }
 }
 
 /*
- * expr - 解析完整表达式
- * 功能：解析完整的表达式，从最低优先级开始
+ * ra_load - 生成"mov n(%ebp), %reg"
+ * 输入：r - 寄存器号，n - 偏移
+ */
+ra_load(r, n)
+{
+    o(0x8b);
+    glocal(0x85 + r * 8, n);
+}
+
+/*
+ * ra_enter - 函数入口
+ * 功能：在局部变量下面保存使用的寄存器，并把寄存器中的参数读入
  * 输入：无
- * 输出：无（结果在EAX寄存器中）
- * 状态变化：通过sum()函数改变代码生成状态
- * 主要逻辑：调用sum(11)从最低优先级开始解析表达式
+ * 输出：无
+ * 状态变化：代码缓冲区添加push和mov指令
  */
-expr()
+ra_enter()
 {
-    sum(11);
+    int a, r;
+
+    r = 3;
+    while (r < 8) {
+        if (ra_used >> r & 1)
+            o(0x50 + r); /* push %reg */
+        r++;
+    }
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)(a + 12) > 0 && *(int *)(a + 20) > 0)
+            ra_load(*(int *)(a + 12), *(int *)(a + 20));
+        a = a + 24;
+    }
 }
 
+/*
+ * ra_restore - 恢复保存的寄存器
+ * 功能：保存的寄存器在局部变量（ra_loc字节）下面
+ * 状态变化：代码缓冲区添加mov指令
+ */
+ra_restore()
+{
+    int r, n;
+
+    n = -ra_loc;
+    r = 3;
+    while (r < 8) {
+        if (ra_used >> r & 1) {
+            n = n - 4;
+            ra_load(r, n);
+        }
+        r++;
+    }
+}
 
 /*
- * test_expr - 解析测试表达式
- * 功能：解析表达式并生成条件跳转，用于if/while等语句
+ * ra_leave - 函数出口
+ * 功能：恢复保存的寄存器，变量的值恢复为栈偏移（和不用-O时一样，
+ *       局部变量在函数结束后保留它的偏移）
  * 输入：无
- * 输出：返回条件跳转指令的地址（用于后续回填）
- * 状态变化：
- *   - 通过expr()生成表达式计算代码
- *   - 通过gtst()生成条件跳转指令
- * 主要逻辑：
- *   1. 调用expr()计算表达式值
- *   2. 调用gtst(0,0)生成je指令（表达式为假时跳转）
+ * 输出：无
+ * 状态变化：代码缓冲区添加mov指令，清空ra_tab
  */
-test_expr()
+ra_leave()
 {
-    expr();
-    return gtst(0, 0);
+    int a;
+
+    ra_restore();
+    a = ra_tab;
+    while (a < ra_end) {
+        if (*(int *)(a + 20))
+            *(int *)*(int *)a = *(int *)(a + 20);
+        a = a + 24;
+    }
+    ra_end = ra_tab;
+    ra_used = 0;
 }
 
 /*
- * block - 解析语句块
- * 功能：解析各种类型的语句（if、while、for、复合语句、表达式语句等）
- * 输入：l - 用于break语句的跳转链表指针
- * 输出：无
- * 状态变化：
- *   - 代码缓冲区添加语句对应的指令
- *   - 可能修改rsym（return语句跳转链）
- *   - 可能调用next()更新token状态
+ * ra_tail - 尾调用（-O）
+ * 功能：把"return f(...);"编译成跳转
+ * 输入：无（当前token是return后面的名字f）
+ * 输出：生成了跳转时为1，否则为0（什么也不做）
+ * 状态变化：代码缓冲区添加指令，读完')'
  * 主要逻辑：
- *   1. if语句：处理条件跳转和else分支
- *   2. while/for循环：处理循环条件和跳转
- *   3. 复合语句（{}）：处理局部声明和嵌套语句
- *   4. return语句：生成返回跳转
- *   5. break语句：添加到break跳转链
- *   6. 表达式语句：计算表达式值
+ *   1. 取了参数或局部变量的地址时不做（栈帧在调用之后还可能被使用）
+ *   2. 参数依次计算并push，最后一个留在%eax中
+ *   3. 调用函数自己且参数个数相同：参数放进它的参数（寄存器或栈），
+ *      跳到ra_top（序言之后），递归变成循环
+ *   4. 调用其他函数且参数不比自己的多：参数放进自己的参数所在的栈
+ *      位置，恢复寄存器，leave后jmp到f
  */
-block(l)
+ra_tail()
 {
-    int a, n, t;
+    int t, a, c, v, m, n;
 
-    if (tok == TOK_IF) {
-        next();
-        skip('(');
-        a = test_expr();
-        skip(')');
-        block(l);
-        if (tok == TOK_ELSE) {
+    t = tok;
+    if (!ra_top | ra_addr | !ra_rd | t <= TOK_DEFINE)
+        return 0;
+    if (*(int *)ra_rd != '(' || *(int *)ra_paren(ra_rd) != ';')
+        return 0;
+    a = su_args(ra_rd + 12);
+    m = t == *(int *)ra_tok;
+    if (a > ra_arg | a & 1 | m & a != ra_arg || ra_find_inl(t))
+        return 0;
+    n = *(int *)t;
+    /* forward reference: try dlsym */
+    if (!n)
+        n = dlsym(0, *(int *)(t + 12));
+    next();
+    next();
+    a = 0;
+    while (tok != ')') {
+        expr();
+        o(0x50); /* push %eax */
+        su_sp = su_sp + 4;
+        a = a + 4;
+        if (tok == ',')
             next();
-            n = gjmp(0); /* jmp */
-            gsym(a);
-            block(l);
-            gsym(n); /* patch else jmp */
-        } else {
-            gsym(a); /* patch if test */
-        }
-    } else if (tok == TOK_WHILE | tok == TOK_FOR) {
-        t = tok;
-        next();
-        skip('(');
-        if (t == TOK_WHILE) {
-            n = ind;
-            a = test_expr();
-        } else {
-            if (tok != ';')
-                expr();
-            skip(';');
-            n = ind;
-            a = 0;
-            if (tok != ';')
-                a = test_expr();
-            skip(';');
-            if (tok != ')') {
-                t = gjmp(0);
-                expr();
-                gjmp(n - ind - 5);
-                gsym(t);
-                n = t + 4;
+    }
+    next();
+    c = a;
+    while (a) {
+        a = a - 4;
+        su_sp = su_sp - 4;
+        v = a + 8;
+        if (m)
+            v = *(int *)*(int *)(ra_tok + 24 + a * 6);
+        if (a + 4 == c) {
+            /* the last argument is still in %eax */
+            ind--;
+            if (v & 3)
+                o(0xc089 + v * 0x100); /* mov %eax, %reg */
+            else {
+                o(0x89); /* mov %eax, xx(%ebp) */
+                glocal(0x85, v);
             }
+        } else if (v & 3)
+            o(0x58 + v); /* pop %reg */
+        else {
+            o(0x8f); /* pop xx(%ebp) */
+            glocal(0x85, v);
+        }
+    }
+    if (m)
+        gjmp(ra_top - ind - 5);
+    else {
+        ra_restore();
+        o(0xc9); /* leave */
+        if (n)
+            oad(0xe9, n - ind - 5); /* jmp xxx */
+        else {
+            /* forward reference */
+            t = t + 4;
+            *(int *)t = psym(0xe9, *(int *)t);
         }
-        skip(')');
-        block(&a);
-        gjmp(n - ind - 5); /* jmp */
-        gsym(a);
-    } else if (tok == '{') {
-        next();
-        /* declarations */
-        decl(1);
-        while(tok != '}')
-            block(l);
-        next();
-    } else {
-        if (tok == TOK_RETURN) {
-            next();
-            if (tok != ';')
-                expr();
-            rsym = gjmp(rsym); /* jmp */
-        } else if (tok == TOK_BREAK) {
-            next();
-            *(int *)l = gjmp(*(int *)l);
-        } else if (tok != ';')
-            expr();
-        skip(';');
     }
+    return 1;
 }
 
 /*
@@ -798,6 +3351,7 @@ block(l)
  *   2. 函数定义：
  *      - 设置函数入口地址
  *      - 解析参数列表
+ *      - -O时先读入函数的token并分配寄存器（ra_scan）
  *      - 生成函数序言（push %ebp, mov %esp, %ebp）
  *      - 解析函数体
  *      - 生成函数尾声（leave, ret）
@@ -813,7 +3367,7 @@ decl(l)
             while (tok != ';') {
                 if (l) {
                     loc = loc + 4;
-                    *(int *)tok = -loc;
+                    ra_set(tok, -loc);
                 } else {
                     *(int *)tok = glo;
                     glo = glo + 4;
@@ -829,12 +3383,17 @@ decl(l)
             gsym(*(int *)(tok + 4));
             /* put function address */
             *(int *)tok = ind;
+            if (opt) {
+                ra_read();
+                ra_scan();
+                ra_keep();
+            }
             next();
             skip('(');
             a = 8;
             while (tok != ')') {
                 /* read param name and compute offset */
-                *(int *)tok = a;
+                ra_set(tok, a);
                 a = a + 4;
                 next();
                 if (tok == ',')
@@ -843,15 +3402,126 @@ decl(l)
             next(); /* skip ')' */
             rsym = loc = 0;
             o(0xe58955); /* push   %ebp, mov %esp, %ebp */
-            a = oad(0xec81, 0); /* sub $xxx, %esp */
+            if (opt) {
+                /* the locals are known */
+                gesp(0xec, ra_loc); /* sub $xxx, %esp */
+                a = 0;
+            } else
+                a = oad(0xec81, 0); /* sub $xxx, %esp */
+            ra_enter();
+            if (opt) {
+                gesp(0xec, ra_out); /* sub $xxx, %esp */
+                ra_top = ind;
+            }
             block(0);
+            ra_top = 0;
             gsym(rsym);
+            ra_leave();
             o(0xc3c9); /* leave, ret */
-            *(int *)a = loc; /* save local variables */
+            if (a)
+                *(int *)a = loc; /* save local variables */
+        }
+    }
+}
+
+/*
+ * prog_exec - 把代码区改为只读可执行
+ * 功能：代码生成结束后，在运行程序之前把代码区改为读+执行（W^X）
+ * 输入：无
+ * 输出：无
+ * 状态变化：prog..ind所在的页变为PROT_READ | PROT_EXEC
+ * 主要逻辑：
+ *   1. 代码区是单独的arena，编译时只可读写，因此不需要可执行的
+ *      数据段（-Wl,-z,execstack）
+ *   2. 代码超过HUGE_SIZE时后面的部分在写入时就位于透明大页中（见
+ *      main），减少i-TLB缺失；这时按大页取整，mprotect()不拆分
+ *      最后一个大页
+ */
+prog_exec()
+{
+    int n;
+
+    n = ind - prog + 0xfff & -0x1000;
+    if (n > HUGE_SIZE)
+        n = n + HUGE_SIZE - 1 & -HUGE_SIZE;
+    if (mprotect(prog, n, PROT_READ | PROT_EXEC)) {
+        perror("mprotect");
+        exit(1);
+    }
+}
+
+/*
+ * mem_report - 打印编译使用的内存（--mem-stats）
+ * 功能：在stderr上以'key=value'的行输出各缓冲区的使用量，便于CI解析
+ * 输入：无
+ * 输出：无
+ * 状态变化：无
+ * 主要逻辑：
+ *   1. 缓冲区只增长，当前使用量就是峰值
+ *   2. 遍历符号的define链表统计宏占用的字节（每个token 16字节）
+ */
+mem_report()
+{
+    int a, t, m;
+
+    m = 0;
+    a = vars + TOK_IDENT;
+    while (a < vars + TOK_IDENT + sym_cnt * SYM_SIZE) {
+        t = *(int *)(a + 8);
+        while (t) {
+            m = m + 16;
+            if (*(int *)t == -1)
+                break;
+            t = *(int *)(t + 12);
+        }
+        a = a + SYM_SIZE;
+    }
+    fprintf(stderr, "sym_stk=%d\n", dstk - sym_stk);
+    fprintf(stderr, "vars=%d\n", TOK_IDENT + sym_cnt * SYM_SIZE);
+    fprintf(stderr, "data=%d\n", glo - data);
+    fprintf(stderr, "code=%d\n", ind - prog);
+    fprintf(stderr, "symbols=%d\n", sym_cnt);
+    fprintf(stderr, "macro_bytes=%d\n", m);
+    fprintf(stderr, "string_bytes=%d\n", str_bytes);
+}
+
+#ifdef BENCH
+
+/*
+ * bench - 词法分析基准测试（-DBENCH）
+ * 功能：把源代码用next()读n遍，打印token数和每秒的token数
+ * 输入：n - 遍数
+ * 输出：无（结束程序）
+ * 主要逻辑：第一遍之后符号都已经登记，测量的主要是读取字符、识别
+ *           操作符和查找标识符，例如otccbench.c中的表达式
+ */
+bench(n)
+{
+    struct timespec a, b;
+    int c, i;
+    double s;
+
+    c = 0;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    i = n;
+    while (i--) {
+        fptr = file;
+        inp();
+        next();
+        while (tok != -1) {
+            c++;
+            next();
         }
     }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    s = b.tv_sec - a.tv_sec + (b.tv_nsec - a.tv_nsec) / 1e9;
+    printf("%d tokens in %.1f ms: %.1f Mtokens/s\n", c, s * 1e3,
+           c / s / 1e6);
+    exit(0);
 }
 
+#endif
+
 /*
  * main - 编译器主函数
  * 功能：初始化编译器环境，执行编译过程，运行生成的代码
@@ -862,32 +3532,85 @@ decl(l)
  *   - 设置符号表（关键字）
  *   - 分配代码、数据、变量等缓冲区
  * 主要逻辑：
- *   1. 处理命令行参数，确定输入文件
+ *   1. 处理命令行参数（-t cache指定token缓存，-j在单独的线程中进行
+ *      词法分析，-jN用N个线程并行词法分析，-O优化，--mem-stats打印
+ *      内存使用量），确定输入文件
  *   2. 初始化符号表，预设C语言关键字
  *   3. 分配内存缓冲区（代码、全局数据、变量表）
- *   4. 开始词法分析和语法分析
- *   5. 解析全局声明
- *   6. 执行生成的机器码（调用编译后的main函数）
+ *   4. 打开token缓存，需要时启动词法分析线程，开始语法分析
+ *   5. 解析全局声明，保存token缓存
+ *   6. 代码区改为只读可执行，执行生成的机器码（调用编译后的main函数）
  */
 main(n, t)
 {
-    file = stdin;
-    if (n-- > 1) {
+    while (n > 1 && *(char *)*(int *)(t + 4) == '-') {
         t = t + 4;
-        file = fopen(*(int *)t, "r");
+        n--;
+        if (!strcmp(*(int *)t, "-t")) {
+            t = t + 4;
+            n--;
+            tcache = *(int *)t;
+        } else if (!strcmp(*(int *)t, "-j"))
+            ring = 1;
+        else if (!strcmp(*(int *)t, "--mem-stats"))
+            mem_stats = 1;
+        else if (!strcmp(*(int *)t, "-O"))
+            opt = 1;
+        else if (!strncmp(*(int *)t, "-j", 2))
+            lex_jobs = atoi(*(int *)t + 2);
     }
+    if (n-- > 1) {
+        t = t + 4;
+        src_load(*(int *)t);
+    } else
+        src_load(0);
     // Allocate symbol table and initialize keywords
-    sym_stk = calloc(1, ALLOC_SIZE);
-    strcpy(sym_stk, " int if else while break return for define main ");
-    dstk = sym_stk + TOK_STR_SIZE;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        simd = 2;
+    else if (__builtin_cpu_supports("sse2"))
+        simd = 1;
+    arena_next = ARENA_BASE;
+    dstk = sym_stk = arena(ARENA_SIZE);
+    vars = arena(ARENA_SIZE);
+    sym_hash = calloc(4, HASH_SIZE);
+    sym_init();
+    op_init();
     
     // Allocate global data space
-    glo = calloc(1, ALLOC_SIZE);
-    ind = prog = calloc(1, ALLOC_SIZE);
-    vars = calloc(1, ALLOC_SIZE);
+    glo = data = arena(ARENA_SIZE);
+    /* the code arena starts on a huge page. The advice is given before
+       the pages are touched: a large program gets huge pages when it is
+       written, a small one stays in small pages. */
+    arena_next = arena_next + HUGE_SIZE - 1 & -HUGE_SIZE;
+    ind = prog = arena(ARENA_SIZE);
+#ifdef MADV_HUGEPAGE
+    madvise(prog + HUGE_SIZE, ARENA_SIZE - HUGE_SIZE, MADV_HUGEPAGE);
+#endif
+    str_buf = str_end = arena(ARENA_SIZE);
+    str_hash = calloc(4, HASH_SIZE);
+    if (opt) {
+        ra_tok = ra_tend = malloc(0x1000);
+        ra_tlim = ra_tok + 0x1000;
+    }
+#ifdef BENCH
+    bench(n > 1 ? atoi(*(int *)(t + 4)) : 1000);
+#endif
+    if (tcache)
+        cache_open();
     inp();
+    if (lex_jobs)
+        lex_par();
+    if (ring)
+        lex_start();
     next();
     decl(0);
+    cache_save();
+    // 字符串池放在代码之后，和代码一起变为只读
+    str_bytes = str_pool(ind, ind);
+    if (mem_stats)
+        mem_report();
+    ind = ind + str_bytes;
 #ifdef TEST
     { 
         FILE *f;
@@ -897,6 +3620,7 @@ main(n, t)
         return 0;
     }
 #else
+    prog_exec();
     return (*(int (*)())*(int *)(vars + TOK_MAIN)) (n, t);
 #endif
 }